@@ -0,0 +1,484 @@
+#include "algo.hpp"
+#include "fcm.hpp"
+#include "knn.hpp"
+#include "quantize.hpp"
+#include "cache.hpp"
+#include "shard.hpp"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <sstream>
+
+granulation_shape granulation_levels(const our_algo_config &config, size_t num_records, size_t num_granules)
+{
+	granulation_shape shape{num_granules};
+	
+	const size_t fine_chunk_size = std::max(config.granulation.fine_chunk_size, 0);
+	if (!fine_chunk_size || num_records < 2 * fine_chunk_size)
+		return shape;
+		
+	// Every chunk gets enough fine granules to keep its structure (at least as many as the final
+	// granules, up to the square root of its size) and together at least 4 per final granule.
+	// Fine granules should still stand for a few records each - otherwise two levels aren't worth it.
+	shape.num_chunks = num_records / fine_chunk_size;
+	const auto chunk_size = num_records / shape.num_chunks;
+	shape.num_fine_granules = std::max<size_t>(
+		(4 * shape.num_granules + shape.num_chunks - 1) / shape.num_chunks,
+		std::min<size_t>(shape.num_granules, std::sqrt(chunk_size))
+	);
+	shape.num_fine_granules = std::min(shape.num_fine_granules, chunk_size / 4);
+	
+	if (shape.num_fine_granules * shape.num_chunks <= shape.num_granules)
+		return {shape.num_granules};
+		
+	return shape;
+}
+
+sparse_dataset<float> naive_approach(const naive_algo_config &config, const sparse_dataset<float> &dataset)
+{
+	time_budget budget{config.time_budget, {{"knn", 0.7}, {"imputation", 0.1}, {"clustering", 0.2}}};
+	stage_progress knn_progress, clustering_progress;
+	
+	auto t0 = std::chrono::high_resolution_clock::now();
+	auto knn_deadline = budget.begin_stage();
+	knn_table<float> neighbors{0, dataset.num_attributes(), config.imputation.knn_neighbors};
+	if (config.sharding.num_shards > 1)
+	{
+		shard_workspace workspace{config.sharding.directory};
+		neighbors = sharded_knn_search(dataset, config.imputation.knn_neighbors, config.sharding.num_shards, workspace, knn_deadline, &knn_progress);
+	}
+	else
+		neighbors = knn_search(dataset, config.imputation.knn_neighbors, config.imputation.precision, knn_deadline, &knn_progress);
+		
+	budget.end_stage(knn_progress);
+	
+	// Imputation can't be cut short, but the search leaves it its share of the budget
+	budget.begin_stage();
+	auto imputed = knn_apply(dataset, neighbors);
+	budget.end_stage({});
+	auto t1 = std::chrono::high_resolution_clock::now();
+	
+	sparse_dataset<float> clusters{dataset.num_attributes()};
+	
+	if (config.imputation.print_imputed)
+		*config.output << imputed << "\n";
+		
+	std::vector<size_t> attribs(dataset.num_attributes());
+	std::iota(attribs.begin(), attribs.end(), 0);
+	
+	auto t2 = std::chrono::high_resolution_clock::now();
+	fcm_group(
+		imputed,
+		0,
+		dataset.size(), 
+		attribs,
+		config.clustering.num_final_clusters, 
+		config.clustering.fuzzy_exponent, 
+		config.clustering.iterations,
+		*config.rng,
+		budget.begin_stage(),
+		&clustering_progress
+	);
+	budget.end_stage(clustering_progress);
+	auto t3 = std::chrono::high_resolution_clock::now();
+	
+	using namespace std::chrono_literals;
+	auto t_knn = (t1 - t0) / 1.0s;
+	auto t_clustering = (t3 - t2) / 1.0s;
+	auto t_total = t_knn + t_clustering;
+	
+	if (config.print_times)
+	{
+		*config.output << "t         knn: " << t_knn << "s\n";
+		*config.output << "t  clustering: " << t_clustering << "s\n";
+		*config.output << "t       total: " << t_total << "s\n\n";
+	}
+	
+	if (budget.enabled())
+		budget.print_report(*config.output);
+	
+	return imputed;
+}
+
+sparse_dataset<float> our_approach(const our_algo_config &config, const sparse_dataset<float> &dataset)
+{
+	sparse_dataset<float> granules{dataset.num_attributes()};
+	
+	const bool incremental = !config.incremental.cache_path.empty();
+	const granulation_settings<float> settings{
+		config.granulation.fuzzy_exponent,
+		static_cast<std::uint64_t>(config.granulation.iterations),
+		static_cast<std::uint64_t>(config.granulation.fine_chunk_size),
+		static_cast<std::uint64_t>(config.granulation.fine_iterations),
+		rng_checksum(*config.rng)
+	};
+	granule_cache<float> cache{dataset.num_attributes(), settings, config.imputation.knn_neighbors};
+	
+	const bool cache_loaded = incremental && cache.load(config.incremental.cache_path);
+	std::vector<bool> dirty_granules;
+	std::vector<size_t> cached_granule_ids;
+	size_t num_regranulated = 0;
+	
+	// Partial results of worker processes, when the work is sharded
+	std::optional<shard_workspace> workspace;
+	if (config.sharding.num_shards > 1)
+		workspace.emplace(config.sharding.directory);
+		
+	// Measuring granulation errors for granule counts takes a stage of its own - it's only needed
+	// with granule_error and its unused time goes to the next stages
+	time_budget budget{config.time_budget, {{"granularity", 0.1}, {"granulation", 0.3}, {"knn", 0.35}, {"imputation", 0.05}, {"clustering", 0.2}}};
+	stage_progress granularity_progress, granulation_progress, knn_progress, clustering_progress;
+	
+	auto t0 = std::chrono::high_resolution_clock::now();
+	auto granularity_deadline = budget.begin_stage();
+	
+	std::vector<granulation_shape> shapes;
+	for (size_t source = 0; source < dataset.num_sources(); source++)
+	{
+		auto [record_begin, record_end] = dataset.get_source_data_range(source);
+		auto until = partial_deadline(granularity_deadline, record_end - record_begin, dataset.size() - record_begin);
+		shapes.push_back(source_granulation(config, dataset, record_begin, record_end, until, &granularity_progress));
+	}
+	
+	budget.end_stage(granularity_progress);
+	
+	// Granulate data from each source
+	auto granulation_deadline = budget.begin_stage();
+	
+	if (workspace)
+	{
+		sharded_granulate(
+			dataset,
+			granules,
+			shapes,
+			config.granulation.fuzzy_exponent,
+			config.granulation.iterations,
+			config.granulation.fine_iterations,
+			*config.rng,
+			config.sharding.num_shards,
+			*workspace,
+			granulation_deadline,
+			&granulation_progress
+		);
+	}
+	else
+	{
+		for (size_t source = 0; source < dataset.num_sources(); source++)
+		{
+			auto [record_begin, record_end] = dataset.get_source_data_range(source);
+			auto attribs = dataset.get_record_attribute_ids(record_begin);
+			
+			// Unchanged sources reuse their granules, changed ones are warm-started from them
+			const auto *cached = cache_loaded ? cache.find(dataset.get_source_name(source)) : nullptr;
+			if (cached && (cached->attribs != attribs || cached->num_granules() != shapes[source].num_granules))
+				cached = nullptr;
+				
+			// Cached sources are granulated with a copy of the rng, which is advanced as if they were
+			// granulated from scratch - so that clustering starts from the same state as without the cache
+			auto *source_rng = config.rng;
+			std::mt19937 cached_rng;
+			if (cached)
+			{
+				cached_rng = *config.rng;
+				source_rng = &cached_rng;
+				skip_fcm_granulate_multilevel<float>(*config.rng, shapes[source], record_end - record_begin);
+			}
+			
+			const auto num_granules_before = granules.size();
+			if (cached && cached->num_rows == record_end - record_begin && cached->checksum == source_checksum(dataset, source))
+			{
+				for (size_t i = 0; i < cached->num_granules(); i++)
+				{
+					std::vector<float> granule_attribs(granules.num_attributes(), NAN);
+					for (size_t attrib = 0; attrib < attribs.size(); attrib++)
+						granule_attribs.at(attribs[attrib]) = cached->centers.at(i * attribs.size() + attrib);
+						
+					granules.insert(source, granule_attribs, cached->weights.at(i));
+					cached_granule_ids.push_back(cached->first_granule + i);
+				}
+				
+				dirty_granules.resize(granules.size(), false);
+				continue;
+			}
+			
+			fcm_granulate_multilevel(
+				dataset,
+				granules,
+				record_begin,
+				record_end, 
+				attribs,
+				shapes[source],
+				config.granulation.fuzzy_exponent, 
+				config.granulation.iterations,
+				config.granulation.fine_iterations,
+				*source_rng,
+				cached ? &cached->centers : nullptr,
+				partial_deadline(granulation_deadline, record_end - record_begin, dataset.size() - record_begin),
+				&granulation_progress
+			);
+			
+			num_regranulated++;
+			dirty_granules.resize(granules.size(), true);
+			cached_granule_ids.resize(granules.size(), -1);
+			LOG << "[src " << source << "] granulated " << granules.size() - num_granules_before << " granules\n";
+		}
+	}
+	
+	budget.end_stage(granulation_progress);
+	
+	auto t1 = std::chrono::high_resolution_clock::now();
+	auto knn_deadline = budget.begin_stage();
+	knn_table<float> neighbors{0, granules.num_attributes(), config.imputation.knn_neighbors};
+	size_t num_rescanned = granules.size();
+	if (cache_loaded && cache.has_neighbors())
+	{
+		// Incremental search is cheap and isn't limited by the budget
+		neighbors = cache.remap_neighbors(cached_granule_ids);
+		num_rescanned = knn_search_incremental(granules, neighbors, dirty_granules);
+	}
+	else if (workspace)
+		neighbors = sharded_knn_search(granules, config.imputation.knn_neighbors, config.sharding.num_shards, *workspace, knn_deadline, &knn_progress);
+	else
+		neighbors = knn_search(granules, config.imputation.knn_neighbors, config.imputation.precision, knn_deadline, &knn_progress);
+		
+	budget.end_stage(knn_progress);
+	
+	// Imputation can't be cut short, but the search leaves it its share of the budget
+	budget.begin_stage();
+	auto imputed_granules = knn_apply(granules, neighbors);
+	budget.end_stage({});
+	auto t2 = std::chrono::high_resolution_clock::now();
+	
+	// Results cut short by the budget aren't worth reusing
+	if (incremental && granulation_progress.complete() && knn_progress.complete())
+	{
+		granule_cache<float> updated_cache{dataset.num_attributes(), settings, config.imputation.knn_neighbors};
+		
+		for (size_t source = 0; source < dataset.num_sources(); source++)
+			updated_cache.add_source(dataset, source, granules);
+			
+		updated_cache.set_neighbors(neighbors);
+		updated_cache.save(config.incremental.cache_path);
+	}
+	
+	if (config.imputation.print_imputed)
+		*config.output << imputed_granules << "\n";
+		
+	std::vector<size_t> attribs(dataset.num_attributes());
+	std::iota(attribs.begin(), attribs.end(), 0);
+	
+	auto t3 = std::chrono::high_resolution_clock::now();
+	fcm_group(
+		imputed_granules,
+		0,
+		imputed_granules.size(), 
+		attribs,
+		config.clustering.num_final_clusters, 
+		config.clustering.fuzzy_exponent, 
+		config.clustering.iterations,
+		*config.rng,
+		budget.begin_stage(),
+		&clustering_progress
+	);
+	budget.end_stage(clustering_progress);
+	auto t4 = std::chrono::high_resolution_clock::now();
+	
+	using namespace std::chrono_literals;
+	auto t_granulation = (t1 - t0) / 1.0s;
+	auto t_knn = (t2 - t1) / 1.0s;
+	auto t_clustering = (t4 - t3) / 1.0s;
+	auto t_total = t_granulation + t_knn + t_clustering;
+	
+	if (config.print_times)
+	{
+		*config.output << "t granulation: " << t_granulation << "s\n";
+		*config.output << "t         knn: " << t_knn << "s\n";
+		*config.output << "t  clustering: " << t_clustering << "s\n";
+		*config.output << "t       total: " << t_total << "s\n";
+		
+		if (config.granulation.granule_ratio > 0 || config.granulation.granule_error > 0)
+			*config.output << "    granules: " << granules.size() << " for " << dataset.size() << " records\n";
+			
+		if (incremental)
+		{
+			*config.output << "regranulated: " << num_regranulated << "/" << dataset.num_sources() << " sources\n";
+			*config.output << "   rescanned: " << num_rescanned << "/" << granules.size() << " granules\n";
+		}
+		
+		*config.output << "\n";
+	}
+	
+	if (budget.enabled())
+		budget.print_report(*config.output);
+		
+	return imputed_granules;
+}
+
+bool validate_config(const our_algo_config &config, std::string &error)
+{
+	const bool counts_valid = config.imputation.knn_neighbors >= 1
+		&& config.clustering.num_final_clusters >= 1
+		&& config.clustering.iterations >= 1
+		&& config.granulation.num_granules >= 1
+		&& config.granulation.iterations >= 1;
+		
+	if (!counts_valid)
+	{
+		error = "Numbers of neighbors, clusters, granules and iterations must be positive";
+		return false;
+	}
+	
+	if (!(config.clustering.fuzzy_exponent > 1) || !(config.granulation.fuzzy_exponent > 1))
+	{
+		error = "Fuzzy exponents must be greater than 1";
+		return false;
+	}
+	
+	if (!(config.time_budget >= 0))
+	{
+		error = "Time budget can't be negative";
+		return false;
+	}
+	
+	if (config.imputation.precision != 16 && config.imputation.precision != 32)
+	{
+		error = "Precision must be 16 or 32 bits";
+		return false;
+	}
+	
+	if (!(config.granulation.granule_ratio >= 0) || config.granulation.fine_chunk_size < 0 || config.granulation.fine_iterations < 1)
+	{
+		error = "Invalid granulation parameters";
+		return false;
+	}
+	
+	if (!(config.granulation.granule_error >= 0 && config.granulation.granule_error < 1) || (config.granulation.granule_error > 0 && config.granulation.granule_ratio > 0))
+	{
+		error = "Granule error must be in [0, 1) and can't be combined with granule ratio";
+		return false;
+	}
+	
+	if (config.sharding.num_shards < 1)
+	{
+		error = "Number of shards must be at least 1";
+		return false;
+	}
+	
+	if (config.sharding.num_shards > 1 && (config.imputation.precision != 32 || !config.incremental.cache_path.empty()))
+	{
+		error = "Sharded execution can't be combined with reduced precision or granule cache";
+		return false;
+	}
+	
+	return true;
+}
+
+bool parse_options(run_options &options, const std::vector<std::string> &args, std::string &error, bool remote)
+{
+	auto &config = options.config;
+	
+	std::map<std::string, std::function<void(float)>> arg_actions
+	{
+		{"--naive", [&](auto val){options.use_our_algo = !(val != 0);}},
+		{"--print-result", [&](auto val){options.print_result = val != 0;}},
+		{"--print-dataset", [&](auto val){config.print_dataset = val != 0;}},
+		{"--print-imputed", [&](auto val){config.imputation.print_imputed = val != 0;}},
+		{"--print-times", [&](auto val){config.print_times = val != 0;}},
+		{"--granules", [&](auto val){config.granulation.num_granules = val;}},
+		{"--granule-ratio", [&](auto val){config.granulation.granule_ratio = val;}},
+		{"--granule-error", [&](auto val){config.granulation.granule_error = val;}},
+		{"--fine-chunk", [&](auto val){config.granulation.fine_chunk_size = val;}},
+		{"--fine-iters", [&](auto val){config.granulation.fine_iterations = val;}},
+		{"--clusters", [&](auto val){config.clustering.num_final_clusters = val;}},
+		{"--granulation-exponent", [&](auto val){config.granulation.fuzzy_exponent = val;}},
+		{"--clustering-exponent", [&](auto val){config.clustering.fuzzy_exponent = val;}},
+		{"--granulation-iters", [&](auto val){config.granulation.iterations = val;}},
+		{"--clustering-iters", [&](auto val){config.clustering.iterations = val;}},
+		{"--knn", [&](auto val){config.imputation.knn_neighbors = val;}},
+		{"--knn-precision", [&](auto val){config.imputation.precision = val;}},
+		{"--seed", [&](auto val){options.seed = val;}},
+		{"--time-budget", [&](auto val){config.time_budget = val;}},
+		{"--shards", [&](auto val){config.sharding.num_shards = val;}},
+	};
+	
+	std::map<std::string, std::function<void(const std::string&)>> path_arg_actions
+	{
+		{"--cache", [&](const auto &val){config.incremental.cache_path = val;}},
+		{"--shard-dir", [&](const auto &val){config.sharding.directory = val;}},
+	};
+	
+	for (size_t i = 0; i < args.size(); i += 2)
+	{
+		if (i + 1 >= args.size())
+		{
+			error = "Missing value for option " + args[i];
+			return false;
+		}
+		
+		if (path_arg_actions.contains(args[i]))
+		{
+			if (remote)
+			{
+				error = "Option " + args[i] + " is not available in service mode";
+				return false;
+			}
+			
+			path_arg_actions.at(args[i])(args[i + 1]);
+			continue;
+		}
+		
+		if (!arg_actions.contains(args[i]))
+		{
+			error = "Unknown option " + args[i];
+			return false;
+		}
+		
+		std::stringstream ss{args[i + 1]};
+		float f;
+		
+		// Values end up in ints - anything out of their range is invalid too
+		if (!(ss >> f) || !std::isfinite(f) || std::abs(f) > 1e9f)
+		{
+			error = "Invalid value for option " + args[i];
+			return false;
+		}
+		arg_actions.at(args[i])(f);
+	}
+	
+	if (!validate_config(config, error))
+		return false;
+		
+	// Forking a multithreaded service process isn't safe
+	if (config.sharding.num_shards > 1 && remote)
+	{
+		error = "Sharded execution is not available in service mode";
+		return false;
+	}
+	
+	// More workers than cores only add processes
+	config.sharding.num_shards = std::min(config.sharding.num_shards, static_cast<int>(max_shards()));
+	
+	return true;
+}
+
+void run(run_options options, const sparse_dataset<float> &dataset, std::ostream &s)
+{
+	auto &config = options.config;
+	config.output = &s;
+	
+	if (config.print_dataset)
+		s << dataset << "\n";
+		
+	std::mt19937 rng{options.seed};
+	config.rng = &rng;
+	
+	auto result = options.use_our_algo ? our_approach(config, dataset) : naive_approach(config, dataset);
+	
+	if (options.print_result)
+		s << result << "\n";
+		
+	eval_clustering(result, config.clustering.num_final_clusters, s);
+}
@@ -0,0 +1,233 @@
+#pragma once
+#include "dataset.hpp"
+#include "fcm.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <random>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct naive_algo_config
+{
+	std::mt19937 *rng = nullptr;
+	std::ostream *output = &std::cout;
+	bool print_dataset = false;
+	bool print_times = false;
+	float time_budget = 0; // seconds, 0 - no limit
+	
+	struct
+	{
+		int knn_neighbors = 3;
+		int precision = 32; // bits per value used in neighbor search - 16 or 32
+		bool print_imputed = false;
+	} imputation;
+	
+	struct
+	{
+		float fuzzy_exponent = 2.f;
+		int num_final_clusters = 3;
+		int iterations = 10;
+	} clustering;
+	
+	struct
+	{
+		int num_shards = 1; // worker processes, 1 - everything runs in this process
+		std::filesystem::path directory; // for partial results, empty - system temporary directory
+	} sharding;
+};
+
+struct our_algo_config : public naive_algo_config
+{
+	struct
+	{
+		float fuzzy_exponent = 2.f;
+		int num_granules = 3;
+		int iterations = 10;
+		float granule_ratio = 0; // records per granule, 0 - num_granules granules in every source
+		float granule_error = 0; // share of variance granules may leave unexplained, used when there's no granule_ratio, 0 - num_granules granules
+		int fine_chunk_size = 0; // sources of at least two such chunks are granulated in two levels, 0 - never
+		int fine_iterations = 3;
+	} granulation;
+	
+	struct
+	{
+		std::filesystem::path cache_path; // empty - incremental mode disabled
+	} incremental;
+};
+
+struct run_options
+{
+	our_algo_config config;
+	bool use_our_algo = true;
+	bool print_result = false;
+	long unsigned int seed = 1;
+};
+
+/*
+	Whether a source with given numbers of records and final granules is granulated in two levels
+*/
+granulation_shape granulation_levels(const our_algo_config &config, size_t num_records, size_t num_granules);
+
+// Granulation errors are measured on at most this many records of a source
+constexpr size_t granule_error_sample_size = 1000;
+
+// Largest count picked by the error - granules should stand for a few sampled records each
+constexpr size_t granule_error_max_granules = std::bit_ceil(granule_error_sample_size / 8);
+
+/*
+	Granulation of records [begin_id, end_id) of a source. Number of granules is fixed, one per granule_ratio
+	records or the smallest power of two whose fcm_granulation_error on evenly spaced records is within
+	granule_error. The error is measured with an rng of its own, so that the run's rng isn't affected.
+	The search stops at the deadline with the count it reached and is then reported incomplete.
+*/
+template <typename Input>
+granulation_shape source_granulation(
+	const our_algo_config &config,
+	const Input &input,
+	size_t begin_id,
+	size_t end_id,
+	const deadline &until = {},
+	stage_progress *progress = nullptr)
+{
+	const auto &granulation = config.granulation;
+	const auto num_records = end_id - begin_id;
+	size_t num_granules = granulation.num_granules;
+	
+	if (granulation.granule_ratio > 0)
+		num_granules = std::lround(num_records / granulation.granule_ratio);
+	else if (granulation.granule_error > 0)
+	{
+		const auto sample_size = std::min(num_records, granule_error_sample_size);
+		auto attribs = input.get_record_attribute_ids(begin_id);
+		
+		sparse_dataset<float> sample{input.num_attributes()};
+		for (size_t i = 0; i < sample_size; i++)
+		{
+			auto id = begin_id + i * num_records / sample_size;
+			std::vector<float> row(input.num_attributes(), NAN);
+			for (auto attr_id : attribs)
+				row[attr_id] = *input.get(id, attr_id);
+				
+			sample.insert(0, row, input.get_weight(id));
+		}
+		
+		// A single granule leaves all of the variance
+		std::mt19937 rng{0};
+		num_granules = 2;
+		bool complete = true;
+		while (8 * num_granules < sample_size)
+		{
+			auto error = fcm_granulation_error(sample, 0, sample_size, attribs, num_granules, granulation.fuzzy_exponent, granulation.iterations, rng, until);
+			
+			// Errors of fcm cut short are overestimated - the search ends at the current count
+			if (deadline_passed(until))
+			{
+				complete = false;
+				break;
+			}
+			
+			if (error <= granulation.granule_error)
+				break;
+				
+			num_granules *= 2;
+		}
+		
+		if (progress)
+		{
+			progress->done += complete;
+			progress->total++;
+		}
+	}
+	
+	return granulation_levels(config, num_records, std::clamp<size_t>(num_granules, 1, num_records));
+}
+
+sparse_dataset<float> naive_approach(const naive_algo_config &config, const sparse_dataset<float> &dataset);
+sparse_dataset<float> our_approach(const our_algo_config &config, const sparse_dataset<float> &dataset);
+
+/*
+	Checks ranges and combinations of parameters. The algorithms themselves only check them with asserts,
+	so nothing coming from users (options, service clients, API callers) may skip this.
+	Returns false and describes the problem in `error` on invalid config.
+*/
+bool validate_config(const our_algo_config &config, std::string &error);
+
+/*
+	Applies "--option value" pairs to `options`.
+	Returns false and describes the problem in `error` on invalid input.
+	Options of `remote` callers (service clients) can't refer to files.
+*/
+bool parse_options(run_options &options, const std::vector<std::string> &args, std::string &error, bool remote = false);
+
+/*
+	Runs selected approach on the dataset and writes evaluation to `s`
+*/
+void run(run_options options, const sparse_dataset<float> &dataset, std::ostream &s = std::cout);
+
+template <typename T>
+void eval_clustering(const sparse_dataset<T> &ds, size_t num_clusters, std::ostream &s = std::cout)
+{
+	struct cluster_info
+	{
+		explicit cluster_info(size_t num_attribs) :
+			center(num_attribs),
+			variance(num_attribs)
+		{
+		}
+		
+		std::vector<T> center;
+		std::vector<T> variance;
+		size_t num_items = 0;
+		T weight = 0; // rows are weighted by number of records they stand for
+	};
+	
+	std::vector<cluster_info> clusters(num_clusters, cluster_info(ds.num_attributes()));
+	
+	for (size_t i = 0; i < ds.size(); i++)
+	{
+		auto &cluster = clusters.at(ds.get_source(i));
+		cluster.num_items++;
+		cluster.weight += ds.get_weight(i);
+		
+		for (size_t attrib_id = 0; attrib_id < ds.num_attributes(); attrib_id++)
+			cluster.center.at(attrib_id) += ds.get_weight(i) * ds.get(i, attrib_id).value();
+	}
+	
+	for (auto &cluster : clusters)
+		for (auto &coord : cluster.center)
+			if (cluster.num_items)
+				coord /= cluster.weight;
+				
+	for (size_t i = 0; i < ds.size(); i++)
+	{
+		auto &cluster = clusters.at(ds.get_source(i));
+		
+		for (size_t attrib_id = 0; attrib_id < ds.num_attributes(); attrib_id++)
+		{
+			auto deviation = cluster.center.at(attrib_id) - ds.get(i, attrib_id).value();
+			cluster.variance.at(attrib_id) += ds.get_weight(i) * deviation * deviation;
+		}
+	}
+	
+	for (auto &cluster : clusters)
+		if (cluster.num_items)
+			for (size_t attrib_id = 0; attrib_id < ds.num_attributes(); attrib_id++)
+				cluster.variance.at(attrib_id) /= cluster.weight;
+				
+	s << "ID, Items";
+	for (size_t attrib_id = 0; attrib_id < ds.num_attributes(); attrib_id++)
+		s << ", Var" << attrib_id;
+	s << "\n";
+	
+	for (size_t i = 0; i < clusters.size(); i++)
+		if (clusters[i].num_items)
+		{
+			s << i << ", " << clusters[i].num_items;
+			for (size_t attrib_id = 0; attrib_id < ds.num_attributes(); attrib_id++)
+				s << ", " << clusters[i].variance.at(attrib_id);
+			s << "\n";
+		}
+}
@@ -0,0 +1,218 @@
+#include "api.hpp"
+#include "fcm.hpp"
+#include "knn.hpp"
+#include "quantize.hpp"
+#include <numeric>
+#include <stdexcept>
+
+ntwi_pipeline::ntwi_pipeline(size_t num_attributes) :
+	m_num_attributes(num_attributes)
+{
+}
+
+size_t ntwi_pipeline::add_source_rows(std::span<const float> data, std::span<const size_t> attribute_ids)
+{
+	check_attribute_ids(attribute_ids);
+	if (data.empty() || data.size() % attribute_ids.size())
+		throw std::invalid_argument("source data must hold a whole, non-zero number of rows");
+	
+	auto source = source_view<float>::rows(data, attribute_ids, m_num_attributes, m_sources.size());
+	check_values(source);
+	m_sources.push_back(std::move(source));
+	return m_sources.size() - 1;
+}
+
+size_t ntwi_pipeline::add_source_columns(std::span<const float* const> columns, size_t num_rows, std::span<const size_t> attribute_ids)
+{
+	check_attribute_ids(attribute_ids);
+	if (!num_rows || columns.size() != attribute_ids.size())
+		throw std::invalid_argument("source must have one non-empty column per attribute");
+	
+	auto source = source_view<float>::columns(columns, num_rows, attribute_ids, m_num_attributes, m_sources.size());
+	check_values(source);
+	m_sources.push_back(std::move(source));
+	return m_sources.size() - 1;
+}
+
+size_t ntwi_pipeline::num_records() const
+{
+	size_t num_records = 0;
+	for (const auto &source : m_sources)
+		num_records += source.size();
+	
+	return num_records;
+}
+
+size_t ntwi_pipeline::num_granules(const our_algo_config &config) const
+{
+	check_config(config);
+	
+	size_t num_granules = 0;
+	for (const auto &source : m_sources)
+		num_granules += source_granulation(config, source, 0, source.size()).num_granules;
+		
+	return num_granules;
+}
+
+void ntwi_pipeline::run(const our_algo_config &config, const ntwi_outputs &outputs) const
+{
+	if (!config.rng)
+		throw std::invalid_argument("config.rng must be set");
+	
+	if (m_sources.empty())
+		throw std::invalid_argument("no sources registered");
+	
+	check_config(config);
+	
+	if (config.time_budget > 0 || config.sharding.num_shards > 1 || !config.incremental.cache_path.empty())
+		throw std::invalid_argument("time budget, sharding and granule cache are only supported by our_approach");
+		
+	// Counts may come from granulation errors, which are only measured once
+	std::vector<granulation_shape> shapes;
+	size_t num_granules = 0;
+	for (const auto &source : m_sources)
+	{
+		shapes.push_back(source_granulation(config, source, 0, source.size()));
+		num_granules += shapes.back().num_granules;
+	}
+	
+	if (outputs.granules.size() != num_granules * m_num_attributes || outputs.granule_clusters.size() != num_granules)
+		throw std::invalid_argument("output buffers don't match the number of granules");
+	
+	if (!outputs.record_clusters.empty() && outputs.record_clusters.size() != num_records())
+		throw std::invalid_argument("record cluster buffer doesn't match the number of records");
+	
+	if (!outputs.granule_weights.empty() && outputs.granule_weights.size() != num_granules)
+		throw std::invalid_argument("granule weight buffer doesn't match the number of granules");
+		
+	if (!outputs.granule_spreads.empty() && outputs.granule_spreads.size() != outputs.granules.size())
+		throw std::invalid_argument("granule spread buffer doesn't match the granule buffer");
+		
+	// Granulate data from each source
+	sparse_dataset<float> granules{m_num_attributes};
+	sparse_dataset<float> spreads{m_num_attributes};
+	for (size_t source_id = 0; source_id < m_sources.size(); source_id++)
+	{
+		const auto &source = m_sources[source_id];
+		auto attribs = source.get_attribute_ids();
+		
+		fcm_granulate_multilevel(
+			source,
+			granules,
+			0,
+			source.size(),
+			attribs,
+			shapes[source_id],
+			config.granulation.fuzzy_exponent,
+			config.granulation.iterations,
+			config.granulation.fine_iterations,
+			*config.rng,
+			static_cast<const std::vector<float>*>(nullptr),
+			{},
+			nullptr,
+			outputs.granule_spreads.empty() ? nullptr : &spreads
+		);
+	}
+	
+	auto imputed_granules = knn_apply(granules, knn_search(granules, config.imputation.knn_neighbors, config.imputation.precision));
+	
+	std::vector<size_t> attribs(m_num_attributes);
+	std::iota(attribs.begin(), attribs.end(), 0);
+	
+	fcm_group(
+		imputed_granules,
+		0,
+		imputed_granules.size(),
+		attribs,
+		config.clustering.num_final_clusters,
+		config.clustering.fuzzy_exponent,
+		config.clustering.iterations,
+		*config.rng
+	);
+	
+	for (size_t id = 0; id < imputed_granules.size(); id++)
+	{
+		for (size_t attr_id = 0; attr_id < m_num_attributes; attr_id++)
+			outputs.granules[id * m_num_attributes + attr_id] = imputed_granules.get_ref(id, attr_id);
+		
+		outputs.granule_clusters[id] = imputed_granules.get_source(id);
+		
+		if (!outputs.granule_weights.empty())
+			outputs.granule_weights[id] = granules.get_weight(id);
+			
+		if (!outputs.granule_spreads.empty())
+			for (size_t attr_id = 0; attr_id < m_num_attributes; attr_id++)
+				outputs.granule_spreads[id * m_num_attributes + attr_id] = spreads.get_ref(id, attr_id);
+	}
+	
+	if (outputs.record_clusters.empty())
+		return;
+	
+	// Each record belongs to the cluster of its nearest granule (the one with highest membership)
+	size_t record_offset = 0;
+	for (size_t source_id = 0; source_id < m_sources.size(); source_id++)
+	{
+		const auto &source = m_sources[source_id];
+		auto [granule_begin, granule_end] = granules.get_source_data_range(source_id);
+		
+		for (size_t record_id = 0; record_id < source.size(); record_id++)
+		{
+			size_t best_granule = granule_begin;
+			float best_dist = std::numeric_limits<float>::max();
+			
+			for (size_t granule = granule_begin; granule < granule_end; granule++)
+			{
+				float dist = 0;
+				for (auto attr_id : source.get_attribute_ids())
+				{
+					auto diff = *source.get(record_id, attr_id) - granules.get_ref(granule, attr_id);
+					dist += diff * diff;
+				}
+				
+				if (dist < best_dist)
+				{
+					best_dist = dist;
+					best_granule = granule;
+				}
+			}
+			
+			outputs.record_clusters[record_offset + record_id] = imputed_granules.get_source(best_granule);
+		}
+		
+		record_offset += source.size();
+	}
+}
+
+void ntwi_pipeline::check_config(const our_algo_config &config) const
+{
+	std::string error;
+	if (!validate_config(config, error))
+		throw std::invalid_argument(error);
+}
+
+void ntwi_pipeline::check_attribute_ids(std::span<const size_t> attribute_ids) const
+{
+	if (attribute_ids.empty())
+		throw std::invalid_argument("source must provide at least one attribute");
+	
+	std::vector<bool> seen(m_num_attributes);
+	for (auto attr_id : attribute_ids)
+	{
+		if (attr_id >= m_num_attributes)
+			throw std::invalid_argument("attribute id out of range");
+			
+		if (seen[attr_id])
+			throw std::invalid_argument("duplicate attribute id");
+			
+		seen[attr_id] = true;
+	}
+}
+
+void ntwi_pipeline::check_values(const source_view<float> &source) const
+{
+	// Granulation needs every listed attribute of every record
+	for (size_t id = 0; id < source.size(); id++)
+		for (auto attr_id : source.get_attribute_ids())
+			if (!source.get(id, attr_id))
+				throw std::invalid_argument("source data must not contain NaN - attributes missing in a source are left out of its attribute ids");
+}
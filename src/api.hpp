@@ -0,0 +1,49 @@
+#pragma once
+#include "algo.hpp"
+#include "source_view.hpp"
+#include <span>
+#include <vector>
+
+/*
+	Buffers receiving results of ntwi_pipeline::run - all provided by the caller.
+*/
+struct ntwi_outputs
+{
+	std::span<float> granules;          // num_granules() rows of num_attributes() imputed values
+	std::span<size_t> granule_clusters; // final cluster of each granule
+	std::span<size_t> record_clusters;  // optional - final cluster of each registered record, in registration order
+	std::span<float> granule_weights;   // optional - number of records each granule stands for (fuzzy cardinality)
+	std::span<float> granule_spreads;   // optional - like granules, fuzzy standard deviations of records around them, NaN for imputed values
+};
+
+/*
+	In-process entry point for running our approach on data which is already in memory.
+	Sources are registered as views over caller's buffers and are never copied -
+	the buffers must stay valid until the last run() call.
+*/
+class ntwi_pipeline
+{
+public:
+	explicit ntwi_pipeline(size_t num_attributes);
+	
+	// Each returns id of the new source
+	size_t add_source_rows(std::span<const float> data, std::span<const size_t> attribute_ids);
+	size_t add_source_columns(std::span<const float* const> columns, size_t num_rows, std::span<const size_t> attribute_ids);
+	
+	auto num_attributes() const {return m_num_attributes;}
+	auto num_sources() const {return m_sources.size();}
+	size_t num_records() const;
+	size_t num_granules(const our_algo_config &config) const;
+	
+	// Granulation, imputation and clustering. config.rng must be set. Invalid configs are rejected
+	// like options of the executable are, and so are ones enabling time budget, sharding or granule cache.
+	void run(const our_algo_config &config, const ntwi_outputs &outputs) const;
+	
+private:
+	void check_config(const our_algo_config &config) const;
+	void check_attribute_ids(std::span<const size_t> attribute_ids) const;
+	void check_values(const source_view<float> &source) const;
+	
+	size_t m_num_attributes;
+	std::vector<source_view<float>> m_sources;
+};
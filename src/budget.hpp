@@ -0,0 +1,117 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using deadline_clock = std::chrono::steady_clock;
+
+// Point in time at which a stage should stop - nullopt means no limit
+using deadline = std::optional<deadline_clock::time_point>;
+
+inline bool deadline_passed(const deadline &until)
+{
+	return until && deadline_clock::now() >= *until;
+}
+
+/*
+	Deadline for `part` out of `remaining` units of work - gives it a proportional share of the time left
+*/
+inline deadline partial_deadline(const deadline &until, size_t part, size_t remaining)
+{
+	if (!until)
+		return {};
+		
+	auto now = deadline_clock::now();
+	auto time_left = std::max(*until - now, deadline_clock::duration::zero());
+	return now + time_left * part / remaining;
+}
+
+/*
+	How much of its work a stage managed to do before its deadline
+	(e.g. FCM iterations or kNN record pairs)
+*/
+struct stage_progress
+{
+	size_t done = 0;
+	size_t total = 0;
+	
+	bool complete() const {return done >= total;}
+};
+
+/*
+	Divides wall-clock budget between consecutive stages. Each stage gets its share
+	of the time which is left when it begins, so time saved by a stage goes to the next ones.
+*/
+class time_budget
+{
+public:
+	struct stage
+	{
+		std::string name;
+		double share;
+		deadline_clock::duration allotted{};
+		deadline_clock::duration used{};
+		stage_progress progress;
+	};
+	
+	// Stages are given as names and shares of the budget. Non-positive budget - no limit
+	time_budget(double seconds, const std::vector<std::pair<std::string, double>> &stages)
+	{
+		for (const auto &[name, share] : stages)
+			m_stages.push_back({name, share, {}, {}, {}});
+			
+		if (seconds > 0)
+			m_end = deadline_clock::now() + std::chrono::duration_cast<deadline_clock::duration>(std::chrono::duration<double>(seconds));
+	}
+	
+	bool enabled() const {return m_end.has_value();}
+	
+	deadline begin_stage()
+	{
+		assert(m_current < m_stages.size());
+		m_stage_begin = deadline_clock::now();
+		if (!m_end)
+			return {};
+			
+		double remaining_shares = 0;
+		for (size_t i = m_current; i < m_stages.size(); i++)
+			remaining_shares += m_stages[i].share;
+			
+		auto remaining = std::max(*m_end - m_stage_begin, deadline_clock::duration::zero());
+		auto &stage = m_stages[m_current];
+		stage.allotted = std::chrono::duration_cast<deadline_clock::duration>(remaining * (stage.share / remaining_shares));
+		return m_stage_begin + stage.allotted;
+	}
+	
+	void end_stage(const stage_progress &progress)
+	{
+		auto &stage = m_stages.at(m_current++);
+		stage.used = deadline_clock::now() - m_stage_begin;
+		stage.progress = progress;
+	}
+	
+	void print_report(std::ostream &s) const
+	{
+		using namespace std::chrono_literals;
+		for (const auto &stage : m_stages)
+		{
+			s << "budget " << std::setw(11) << stage.name << ": " << stage.used / 1.0s << "s of " << stage.allotted / 1.0s << "s, ";
+			if (stage.progress.complete())
+				s << "complete\n";
+			else
+				s << "cut short at " << stage.progress.done << "/" << stage.progress.total
+					<< " (" << 100.0 * stage.progress.done / stage.progress.total << "%)\n";
+		}
+	}
+	
+private:
+	std::vector<stage> m_stages;
+	size_t m_current = 0;
+	deadline m_end;
+	deadline_clock::time_point m_stage_begin;
+};
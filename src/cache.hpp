@@ -0,0 +1,392 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <unistd.h>
+#include "dataset.hpp"
+#include "knn.hpp"
+
+template <typename T>
+void binary_write(std::ostream &s, const T &value)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	s.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+void binary_write(std::ostream &s, const std::vector<T> &values)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	binary_write<std::uint64_t>(s, values.size());
+	s.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+inline void binary_write(std::ostream &s, const std::string &str)
+{
+	binary_write<std::uint64_t>(s, str.size());
+	s.write(str.data(), str.size());
+}
+
+template <typename T>
+bool binary_read(std::istream &s, T &value)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	return static_cast<bool>(s.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+template <typename T>
+bool binary_read(std::istream &s, std::vector<T> &values)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	std::uint64_t size;
+	if (!binary_read(s, size))
+		return false;
+		
+	values.resize(size);
+	return static_cast<bool>(s.read(reinterpret_cast<char*>(values.data()), size * sizeof(T)));
+}
+
+inline bool binary_read(std::istream &s, std::string &str)
+{
+	std::uint64_t size;
+	if (!binary_read(s, size))
+		return false;
+		
+	str.resize(size);
+	return static_cast<bool>(s.read(str.data(), size));
+}
+
+/*
+	Writes the file under a temporary name first and then renames it,
+	so that readers (other processes, workers) never see it half-written
+*/
+template <typename F>
+void write_file_atomically(const std::filesystem::path &path, F write)
+{
+	// Unique per process and thread, so that concurrent writers of the same file don't share it
+	auto tmp_path = path;
+	tmp_path += ".tmp." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+	
+	{
+		std::ofstream f{tmp_path, std::ios::binary};
+		write(f);
+		if (!f)
+		{
+			f.close();
+			std::filesystem::remove(tmp_path);
+			throw std::runtime_error("cannot write " + path.string());
+		}
+	}
+	
+	std::filesystem::rename(tmp_path, path);
+}
+
+constexpr std::uint64_t fnv1a_basis = 14695981039346656037ull;
+
+inline std::uint64_t fnv1a(std::uint64_t hash, const void *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 1099511628211ull;
+		
+	return hash;
+}
+
+/*
+	FNV-1a hash of all records from given source - used to detect changed sources
+*/
+template <typename T>
+std::uint64_t source_checksum(const sparse_dataset<T> &ds, size_t source)
+{
+	auto [record_begin, record_end] = ds.get_source_data_range(source);
+	std::uint64_t hash = fnv1a_basis;
+	
+	for (size_t id = record_begin; id < record_end; id++)
+		for (size_t attr_id = 0; attr_id < ds.num_attributes(); attr_id++)
+			hash = fnv1a(hash, &ds.get_ref(id, attr_id), sizeof(T));
+			
+	return hash;
+}
+
+/*
+	Hash of the whole state of a standard random engine - stands in for the seed it was created with
+*/
+template <typename RNG>
+std::uint64_t rng_checksum(const RNG &rng)
+{
+	std::ostringstream state;
+	state << rng;
+	return fnv1a(fnv1a_basis, state.str().data(), state.str().size());
+}
+
+/*
+	Parameters which granules depend on, besides the data and number of granules.
+	Granules made with different ones are not reused.
+*/
+template <typename T>
+struct granulation_settings
+{
+	T fuzzy_exponent = 2;
+	std::uint64_t iterations = 0;
+	std::uint64_t fine_chunk_size = 0;
+	std::uint64_t fine_iterations = 0;
+	std::uint64_t rng_checksum = 0; // state of the rng before granulation
+	
+	bool operator==(const granulation_settings&) const = default;
+};
+
+template <typename T>
+void binary_write(std::ostream &s, const granulation_settings<T> &settings)
+{
+	binary_write(s, settings.fuzzy_exponent);
+	binary_write(s, settings.iterations);
+	binary_write(s, settings.fine_chunk_size);
+	binary_write(s, settings.fine_iterations);
+	binary_write(s, settings.rng_checksum);
+}
+
+template <typename T>
+bool binary_read(std::istream &s, granulation_settings<T> &settings)
+{
+	return binary_read(s, settings.fuzzy_exponent)
+		&& binary_read(s, settings.iterations)
+		&& binary_read(s, settings.fine_chunk_size)
+		&& binary_read(s, settings.fine_iterations)
+		&& binary_read(s, settings.rng_checksum);
+}
+
+/*
+	Granules and granule neighbor lists from a previous run of our approach.
+	Allows re-granulating only sources which were added or changed since.
+	Number of granules is stored per source, so it may differ between sources and runs.
+	Neighbor lists are only usable with the same number of neighbors, granules with any.
+*/
+template <typename T>
+class granule_cache
+{
+public:
+	struct source_entry
+	{
+		std::string name;
+		std::uint64_t num_rows = 0;
+		std::uint64_t checksum = 0;
+		std::vector<size_t> attribs;
+		std::vector<T> centers; // num_granules * attribs.size()
+		std::vector<T> weights; // num_granules
+		size_t first_granule = 0;
+		
+		size_t num_granules() const {return centers.size() / attribs.size();}
+	};
+	
+	granule_cache(size_t num_attributes, const granulation_settings<T> &settings, int knn_neighbors) :
+		m_num_attributes(num_attributes),
+		m_settings(settings),
+		m_knn_neighbors(knn_neighbors)
+	{
+	}
+	
+	const source_entry *find(const std::string &name) const;
+	bool has_neighbors() const {return m_has_neighbors;}
+	void add_source(const sparse_dataset<T> &dataset, size_t source, const sparse_dataset<T> &granules);
+	void set_neighbors(const knn_table<T> &table);
+	knn_table<T> remap_neighbors(const std::vector<size_t> &cached_ids) const;
+	
+	bool load(const std::filesystem::path &path);
+	void save(const std::filesystem::path &path) const;
+	
+private:
+	static constexpr std::uint64_t magic = 0x354843434957544eull; // "NTWICCH5"
+	
+	size_t m_num_attributes;
+	granulation_settings<T> m_settings;
+	int m_knn_neighbors;
+	bool m_has_neighbors = false;
+	std::vector<source_entry> m_sources;
+	std::vector<T> m_neighbor_dists;
+	std::vector<size_t> m_neighbor_ids;
+};
+
+template <typename T>
+const typename granule_cache<T>::source_entry *granule_cache<T>::find(const std::string &name) const
+{
+	for (const auto &entry : m_sources)
+		if (entry.name == name)
+			return &entry;
+			
+	return nullptr;
+}
+
+template <typename T>
+void granule_cache<T>::set_neighbors(const knn_table<T> &table)
+{
+	m_neighbor_dists.clear();
+	m_neighbor_ids.clear();
+	
+	for (const auto &[dist, neighbor_id] : table.entries())
+	{
+		m_neighbor_dists.push_back(dist);
+		m_neighbor_ids.push_back(neighbor_id);
+	}
+}
+
+template <typename T>
+void granule_cache<T>::add_source(const sparse_dataset<T> &dataset, size_t source, const sparse_dataset<T> &granules)
+{
+	auto [record_begin, record_end] = dataset.get_source_data_range(source);
+	auto [granule_begin, granule_end] = granules.get_source_data_range(source);
+	
+	source_entry entry;
+	entry.name = dataset.get_source_name(source);
+	entry.num_rows = record_end - record_begin;
+	entry.checksum = source_checksum(dataset, source);
+	entry.attribs = dataset.get_record_attribute_ids(record_begin);
+	entry.first_granule = granule_begin;
+	
+	for (size_t id = granule_begin; id < granule_end; id++)
+	{
+		for (auto attrib : entry.attribs)
+			entry.centers.push_back(granules.get_ref(id, attrib));
+			
+		entry.weights.push_back(granules.get_weight(id));
+	}
+	
+	m_sources.push_back(std::move(entry));
+}
+
+/*
+	Builds neighbor table for the current granules from the cached one.
+	`cached_ids` maps current granule ids to cached ones (-1 for new granules).
+*/
+template <typename T>
+knn_table<T> granule_cache<T>::remap_neighbors(const std::vector<size_t> &cached_ids) const
+{
+	assert(m_has_neighbors);
+	knn_table<T> table(cached_ids.size(), m_num_attributes, m_knn_neighbors);
+	const size_t num_cached = m_neighbor_ids.size() / (m_num_attributes * m_knn_neighbors);
+	
+	std::vector<size_t> current_ids(num_cached, knn_table<T>::stale_neighbor);
+	for (size_t id = 0; id < cached_ids.size(); id++)
+		if (cached_ids[id] != static_cast<size_t>(-1))
+			current_ids.at(cached_ids[id]) = id;
+			
+	for (size_t id = 0; id < cached_ids.size(); id++)
+	{
+		if (cached_ids[id] == static_cast<size_t>(-1))
+			continue;
+			
+		for (size_t attr_id = 0; attr_id < m_num_attributes; attr_id++)
+		{
+			for (int i = 0; i < m_knn_neighbors; i++)
+			{
+				auto index = (cached_ids[id] * m_num_attributes + attr_id) * m_knn_neighbors + i;
+				auto neighbor_id = m_neighbor_ids.at(index);
+				if (neighbor_id != knn_table<T>::no_neighbor)
+					neighbor_id = current_ids.at(neighbor_id);
+					
+				table.set(id, attr_id, i, {m_neighbor_dists.at(index), neighbor_id});
+			}
+		}
+	}
+	
+	return table;
+}
+
+/*
+	Returns false if the cache doesn't exist or was made with different parameters
+*/
+template <typename T>
+bool granule_cache<T>::load(const std::filesystem::path &path)
+{
+	std::ifstream f{path, std::ios::binary};
+	if (!f)
+		return false;
+		
+	std::uint64_t file_magic, num_attributes, num_sources;
+	granulation_settings<T> settings;
+	int knn_neighbors;
+	
+	bool ok = binary_read(f, file_magic) && file_magic == magic
+		&& binary_read(f, num_attributes) && num_attributes == m_num_attributes
+		&& binary_read(f, settings) && settings == m_settings
+		&& binary_read(f, knn_neighbors) && knn_neighbors > 0
+		&& binary_read(f, num_sources);
+		
+	if (!ok)
+	{
+		LOG << "granule cache " << path << " is missing or outdated\n";
+		return false;
+	}
+	
+	std::vector<source_entry> sources(num_sources);
+	size_t num_granules_total = 0;
+	for (auto &entry : sources)
+	{
+		ok = binary_read(f, entry.name)
+			&& binary_read(f, entry.num_rows)
+			&& binary_read(f, entry.checksum)
+			&& binary_read(f, entry.attribs)
+			&& binary_read(f, entry.centers)
+			&& binary_read(f, entry.weights)
+			&& !entry.attribs.empty()
+			&& entry.weights.size() == entry.num_granules();
+			
+		if (!ok)
+			return false;
+			
+		entry.first_granule = num_granules_total;
+		num_granules_total += entry.num_granules();
+	}
+	
+	const auto num_neighbors = num_granules_total * m_num_attributes * knn_neighbors;
+	std::vector<T> neighbor_dists;
+	std::vector<size_t> neighbor_ids;
+	
+	ok = binary_read(f, neighbor_dists) && neighbor_dists.size() == num_neighbors
+		&& binary_read(f, neighbor_ids) && neighbor_ids.size() == num_neighbors;
+		
+	if (!ok)
+		return false;
+		
+	m_sources = std::move(sources);
+	m_has_neighbors = knn_neighbors == m_knn_neighbors;
+	if (m_has_neighbors)
+	{
+		m_neighbor_dists = std::move(neighbor_dists);
+		m_neighbor_ids = std::move(neighbor_ids);
+	}
+	else
+		LOG << "granule cache " << path << " has neighbor lists for a different k, only granules are reused\n";
+		
+	return true;
+}
+
+template <typename T>
+void granule_cache<T>::save(const std::filesystem::path &path) const
+{
+	write_file_atomically(path, [&](std::ostream &f)
+	{
+		binary_write(f, magic);
+		binary_write<std::uint64_t>(f, m_num_attributes);
+		binary_write(f, m_settings);
+		binary_write(f, m_knn_neighbors);
+		binary_write<std::uint64_t>(f, m_sources.size());
+		
+		for (const auto &entry : m_sources)
+		{
+			binary_write(f, entry.name);
+			binary_write(f, entry.num_rows);
+			binary_write(f, entry.checksum);
+			binary_write(f, entry.attribs);
+			binary_write(f, entry.centers);
+			binary_write(f, entry.weights);
+		}
+		
+		binary_write(f, m_neighbor_dists);
+		binary_write(f, m_neighbor_ids);
+	});
+}
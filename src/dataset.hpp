@@ -12,6 +12,7 @@
 #include <iomanip>
 #include <algorithm>
 #include <span>
+#include <string>
 #include "utils.hpp"
 
 template <typename T>
@@ -32,9 +33,12 @@ public:
 	const T &get_ref(size_t id, size_t attr) const;
 	void set_source(size_t id, size_t source_id) {m_sources.at(id) = source_id;}
 	size_t get_source(size_t id) const {return m_sources.at(id);}
+	T get_weight(size_t id) const {return m_weights.at(id);}
+	void set_weight(size_t id, T weight) {m_weights.at(id) = weight;}
+	const std::string &get_source_name(size_t source) const {return m_source_names.at(source);}
 	std::vector<size_t> get_record_attribute_ids(size_t id) const;
 	std::pair<size_t, size_t> get_source_data_range(size_t source) const;
-	void insert(size_t source_id, const std::span<T> &data);
+	void insert(size_t source_id, const std::span<T> &data, T weight = 1);
 	bool is_valid() const;
 	
 private:
@@ -44,6 +48,8 @@ private:
 	size_t m_num_attributes;
 	std::vector<T> m_data;
 	std::vector<size_t> m_sources;
+	std::vector<T> m_weights; // number of records each row stands for - e.g. fuzzy cardinality of a granule
+	std::vector<std::string> m_source_names;
 };
 
 template <typename T>
@@ -110,6 +116,7 @@ sparse_dataset<T>::sparse_dataset(const std::filesystem::path &dir_path)
 	for (const auto &[path, d] : data_files)
 	{
 		LOG << "[src " << source_id << "] loading " << path << "...\n";
+		m_source_names.push_back(path.filename().string());
 		assert(!d.attributes.empty());
 		assert(!d.data.empty());
 		
@@ -173,12 +180,16 @@ std::pair<size_t, size_t> sparse_dataset<T>::get_source_data_range(size_t source
 }
 
 template <typename T>
-void sparse_dataset<T>::insert(size_t source, const std::span<T> &data)
+void sparse_dataset<T>::insert(size_t source, const std::span<T> &data, T weight)
 {
 	assert(data.size() == num_attributes());
 	assert(m_sources.empty() || m_sources.back() == source || m_sources.back() + 1 == source);
 	
 	add_row(source);
+	m_weights.back() = weight;
+	while (m_source_names.size() <= source)
+		m_source_names.push_back(std::to_string(source));
+		
 	std::copy(data.begin(), data.end(), &m_data[get_index(this->size() - 1, 0)]);
 }
 
@@ -195,6 +206,7 @@ void sparse_dataset<T>::add_row(size_t source)
 {
 	m_data.resize(m_data.size() + num_attributes(), NAN);
 	m_sources.push_back(source);
+	m_weights.push_back(1);
 }
 
 template <typename T>
@@ -1,5 +1,6 @@
 #pragma once
 #include "dataset.hpp"
+#include "budget.hpp"
 #include <optional>
 #include <span>
 #include <random>
@@ -40,6 +41,18 @@ public:
 			u = dist(rng);
 	}
 	
+	/*
+		Advances rng the same way randomize_parition_matrix would for given size of the matrix.
+		Allows to run fcm on later records without running it on the earlier ones first.
+	*/
+	template <typename RNG>
+	static void skip_random_partition_matrix(RNG &rng, size_t num_clusters, size_t num_records)
+	{
+		std::uniform_real_distribution<T> dist{0, 1};
+		for (size_t i = 0; i < num_clusters * num_records; i++)
+			dist(rng);
+	}
+	
 	void normalize_partition_matrix()
 	{
 		for (size_t i = 0; i < m_num_records; i++)
@@ -64,16 +77,24 @@ private:
 	std::vector<T> m_cluster_centers;
 };
 
-template <typename T, typename RNG>
+/*
+	Input may be any dataset-like type providing `get(record_id, attrib)`
+	returning std::optional<T> and `get_weight(record_id)` - e.g. sparse_dataset or source_view.
+	Cluster centers are means weighted by both memberships and record weights.
+*/
+template <typename T, typename Input, typename RNG>
 fcm_result<T> fcm(
-	const sparse_dataset<T> &input,
+	const Input &input,
 	const size_t begin_id,
 	const size_t end_id,
 	const std::span<size_t> &attrib_ids,
 	const size_t num_clusters,
 	const T exponent,
 	const size_t num_iterations,
-	RNG &rng)
+	RNG &rng,
+	const std::vector<T> *initial_centers = nullptr,
+	const deadline &until = {},
+	stage_progress *progress = nullptr)
 {
 	const auto num_records = end_id - begin_id;
 	const auto num_attribs = attrib_ids.size();
@@ -93,31 +114,32 @@ fcm_result<T> fcm(
 		return cluster_distances.at(cluster_id * num_records + record_id);
 	};
 	
-	result.randomize_parition_matrix(rng);
-	result.normalize_partition_matrix();
-	
-	for (size_t iter = 0; iter < num_iterations; iter++)
+	auto update_cluster_centers = [&]()
 	{
-		// Update cluster centers
+		std::vector<T> center(num_attribs);
 		for (size_t cluster_id = 0; cluster_id < num_clusters; cluster_id++)
 		{
-			for (size_t attrib = 0; attrib < num_attribs; attrib++)
-				result.cluster_center_attrib(cluster_id, attrib) = 0;
+			std::fill(center.begin(), center.end(), 0);
 			
 			T factor_sum = 0;
 			for (size_t record_id = begin_id; record_id < end_id; record_id++)
 			{
-				auto factor = std::pow(result.membership_value(cluster_id, record_id - begin_id), exponent);
+				auto factor = input.get_weight(record_id) * std::pow(result.membership_value(cluster_id, record_id - begin_id), exponent);
 				factor_sum += factor;
 				
 				for (size_t attrib = 0; attrib < num_attribs; attrib++)
-					result.cluster_center_attrib(cluster_id, attrib) += factor * *input.get(record_id, attrib_ids.at(attrib));
+					center[attrib] += factor * *input.get(record_id, attrib_ids[attrib]);
 			}
 			
+			// A cluster left without members (all records coincide with other clusters) keeps its center
 			for (size_t attrib = 0; attrib < num_attribs; attrib++)
-				result.cluster_center_attrib(cluster_id, attrib) /= factor_sum;
+				if (factor_sum > 0)
+					result.cluster_center_attrib(cluster_id, attrib) = center[attrib] / factor_sum;
 		}
-		
+	};
+	
+	auto update_partition_matrix = [&]()
+	{
 		// Update record/cluster distances
 		for (size_t cluster_id = 0; cluster_id < num_clusters; cluster_id++)
 		{
@@ -126,37 +148,83 @@ fcm_result<T> fcm(
 				cluster_distance(cluster_id, record_id - begin_id) = 0;
 				for (size_t attrib = 0; attrib < num_attribs; attrib++)
 				{
-					auto diff = *input.get(record_id, attrib_ids.at(attrib)) - result.cluster_center_attrib(cluster_id, attrib);
+					auto diff = *input.get(record_id, attrib_ids[attrib]) - result.cluster_center_attrib(cluster_id, attrib);
 					cluster_distance(cluster_id, record_id - begin_id) += diff * diff;
 				}
 			}
 		}
 		
-		// Update partition matrix
+		// Update partition matrix. A record coinciding with some clusters belongs only to them
+		// (equally) - the usual formula would divide by zero.
 		for (size_t cluster_id = 0; cluster_id < num_clusters; cluster_id++)
 		{
 			for (size_t record_id = begin_id; record_id < end_id; record_id++)
 			{
+				const auto distance = cluster_distance(cluster_id, record_id - begin_id);
 				T sum = 0;
+				size_t num_coinciding = 0;
 				for (size_t i = 0; i < num_clusters; i++)
-					sum += std::pow(
-						cluster_distance(cluster_id, record_id - begin_id) / cluster_distance(i, record_id - begin_id),
-						1 / (exponent - 1)
-					);
+				{
+					if (cluster_distance(i, record_id - begin_id) == 0)
+						num_coinciding++;
+					else
+						sum += std::pow(distance / cluster_distance(i, record_id - begin_id), 1 / (exponent - 1));
+				}
 				
-				result.membership_value(cluster_id, record_id - begin_id) = 1 / sum;
+				if (num_coinciding)
+					result.membership_value(cluster_id, record_id - begin_id) = distance == 0 ? T(1) / num_coinciding : 0;
+				else
+					result.membership_value(cluster_id, record_id - begin_id) = 1 / sum;
 			}
 		}
 		
+		result.normalize_partition_matrix();
+	};
+	
+	if (initial_centers)
+	{
+		// Warm start - derive memberships from the provided centers instead of random ones
+		assert(initial_centers->size() == num_clusters * num_attribs);
+		for (size_t cluster_id = 0; cluster_id < num_clusters; cluster_id++)
+			for (size_t attrib = 0; attrib < num_attribs; attrib++)
+				result.cluster_center_attrib(cluster_id, attrib) = (*initial_centers)[cluster_id * num_attribs + attrib];
+				
+		update_partition_matrix();
+	}
+	else
+	{
+		result.randomize_parition_matrix(rng);
 		result.normalize_partition_matrix();
 	}
 	
+	// At least one iteration is always done - until then there are no valid centers
+	size_t iter = 0;
+	while (iter < num_iterations)
+	{
+		update_cluster_centers();
+		update_partition_matrix();
+		iter++;
+		
+		if (deadline_passed(until))
+			break;
+	}
+	
+	if (progress)
+	{
+		progress->done += iter;
+		progress->total += num_iterations;
+	}
+	
 	return result;
 }
 
-template <typename T, typename RNG>
+/*
+	Each granule is weighted with its fuzzy cardinality - sum of memberships of the records it was made of.
+	When `spreads` is given, it receives a row of fuzzy standard deviations of the records around each granule.
+*/
+template <typename T, typename Input, typename RNG>
 void fcm_granulate(
-	const sparse_dataset<T> &input,
+	const Input &input,
 	sparse_dataset<T> &output,
 	const size_t begin_id,
 	const size_t end_id,
@@ -164,7 +232,11 @@ void fcm_granulate(
 	const size_t num_clusters,
 	const T exponent,
 	const size_t num_iterations,
-	RNG &rng)
+	RNG &rng,
+	const std::vector<T> *initial_centers = nullptr,
+	const deadline &until = {},
+	stage_progress *progress = nullptr,
+	sparse_dataset<T> *spreads = nullptr)
 {
 	assert(input.num_attributes() == output.num_attributes());
 	const auto num_attribs = attrib_ids.size();
@@ -177,7 +249,10 @@ void fcm_granulate(
 		num_clusters,
 		exponent,
 		num_iterations,
-		rng
+		rng,
+		initial_centers,
+		until,
+		progress
 	);
 	
 	for (size_t cluster_id = 0; cluster_id < num_clusters; cluster_id++)
@@ -185,10 +260,184 @@ void fcm_granulate(
 		std::vector<T> granule_attribs(output.num_attributes(), NAN);
 		
 		for (size_t attrib = 0; attrib < num_attribs; attrib++)
-			granule_attribs.at(attrib_ids.at(attrib)) = result.cluster_center_attrib(cluster_id, attrib);
+			granule_attribs.at(attrib_ids[attrib]) = result.cluster_center_attrib(cluster_id, attrib);
+			
+		T cardinality = 0;
+		for (size_t record_id = begin_id; record_id < end_id; record_id++)
+			cardinality += input.get_weight(record_id) * result.membership_value(cluster_id, record_id - begin_id);
+			
+		output.insert(input.get_source(begin_id), granule_attribs, cardinality);
+		
+		if (!spreads)
+			continue;
+			
+		std::vector<T> granule_spreads(output.num_attributes(), NAN);
+		for (size_t attrib = 0; attrib < num_attribs; attrib++)
+		{
+			T factor_sum = 0;
+			T deviation_sum = 0;
+			for (size_t record_id = begin_id; record_id < end_id; record_id++)
+			{
+				auto factor = input.get_weight(record_id) * std::pow(result.membership_value(cluster_id, record_id - begin_id), exponent);
+				auto deviation = *input.get(record_id, attrib_ids[attrib]) - result.cluster_center_attrib(cluster_id, attrib);
+				factor_sum += factor;
+				deviation_sum += factor * deviation * deviation;
+			}
+			
+			// Granules without members (see fcm) have no spread
+			granule_spreads.at(attrib_ids[attrib]) = factor_sum > 0 ? std::sqrt(deviation_sum / factor_sum) : 0;
+		}
+		
+		spreads->insert(input.get_source(begin_id), granule_spreads);
+	}
+}
+
+/*
+	Share of the variance of records [begin_id, end_id) which `num_clusters` granules leave unexplained,
+	averaged over attributes - sum of weight * membership^m * (value - center)^2 over sum of weight * (value - mean)^2.
+	A single granule gives 1, granules matching all records give 0. Attributes without variance are skipped.
+*/
+template <typename T, typename Input, typename RNG>
+T fcm_granulation_error(
+	const Input &input,
+	const size_t begin_id,
+	const size_t end_id,
+	const std::span<size_t> &attrib_ids,
+	const size_t num_clusters,
+	const T exponent,
+	const size_t num_iterations,
+	RNG &rng,
+	const deadline &until = {})
+{
+	auto result = fcm<T>(input, begin_id, end_id, attrib_ids, num_clusters, exponent, num_iterations, rng, nullptr, until);
+	
+	T error_sum = 0;
+	size_t num_varying = 0;
+	for (size_t attrib = 0; attrib < attrib_ids.size(); attrib++)
+	{
+		T weight_sum = 0;
+		T mean = 0;
+		for (size_t record_id = begin_id; record_id < end_id; record_id++)
+		{
+			weight_sum += input.get_weight(record_id);
+			mean += input.get_weight(record_id) * *input.get(record_id, attrib_ids[attrib]);
+		}
+		
+		mean /= weight_sum;
+		
+		T variance = 0;
+		T residual = 0;
+		for (size_t record_id = begin_id; record_id < end_id; record_id++)
+		{
+			auto value = *input.get(record_id, attrib_ids[attrib]);
+			variance += input.get_weight(record_id) * (value - mean) * (value - mean);
+			
+			for (size_t cluster_id = 0; cluster_id < num_clusters; cluster_id++)
+			{
+				auto deviation = value - result.cluster_center_attrib(cluster_id, attrib);
+				residual += input.get_weight(record_id) * std::pow(result.membership_value(cluster_id, record_id - begin_id), exponent) * deviation * deviation;
+			}
+		}
 		
-		output.insert(input.get_source(begin_id), granule_attribs);
-	}	
+		if (variance > 0)
+		{
+			error_sum += residual / variance;
+			num_varying++;
+		}
+	}
+	
+	return num_varying ? error_sum / num_varying : 0;
+}
+
+/*
+	How a source is granulated. With a single chunk - directly into `num_granules` granules.
+	Otherwise in two levels - every chunk of records is granulated into `num_fine_granules`
+	granules first, which are then granulated (weighted by their cardinalities) into the final ones.
+*/
+struct granulation_shape
+{
+	size_t num_granules;
+	size_t num_chunks = 1;
+	size_t num_fine_granules = 0; // per chunk
+	
+	// Records [begin, end) of i-th out of num_chunks chunks of [0, num_records)
+	std::pair<size_t, size_t> chunk(size_t i, size_t num_records) const
+	{
+		return {num_records * i / num_chunks, num_records * (i + 1) / num_chunks};
+	}
+};
+
+/*
+	fcm_granulate following the shape. Fine granules are made with `fine_iterations`
+	iterations, which is usually much less than needed for the final ones.
+	In two levels, spreads are measured over the fine granules, not the records.
+*/
+template <typename T, typename Input, typename RNG>
+void fcm_granulate_multilevel(
+	const Input &input,
+	sparse_dataset<T> &output,
+	const size_t begin_id,
+	const size_t end_id,
+	const std::span<size_t> &attrib_ids,
+	const granulation_shape &shape,
+	const T exponent,
+	const size_t num_iterations,
+	const size_t fine_iterations,
+	RNG &rng,
+	const std::vector<T> *initial_centers = nullptr,
+	const deadline &until = {},
+	stage_progress *progress = nullptr,
+	sparse_dataset<T> *spreads = nullptr)
+{
+	if (shape.num_chunks == 1)
+	{
+		fcm_granulate(input, output, begin_id, end_id, attrib_ids, shape.num_granules, exponent, num_iterations, rng, initial_centers, until, progress, spreads);
+		return;
+	}
+	
+	sparse_dataset<T> fine{output.num_attributes()};
+	for (size_t i = 0; i < shape.num_chunks; i++)
+	{
+		auto [chunk_begin, chunk_end] = shape.chunk(i, end_id - begin_id);
+		
+		fcm_granulate(
+			input,
+			fine,
+			begin_id + chunk_begin,
+			begin_id + chunk_end,
+			attrib_ids,
+			shape.num_fine_granules,
+			exponent,
+			fine_iterations,
+			rng,
+			static_cast<const std::vector<T>*>(nullptr),
+			partial_deadline(until, chunk_end - chunk_begin, end_id - begin_id - chunk_begin),
+			progress
+		);
+	}
+	
+	fcm_granulate(fine, output, 0, fine.size(), attrib_ids, shape.num_granules, exponent, num_iterations, rng, initial_centers, until, progress, spreads);
+}
+
+/*
+	Advances rng the same way fcm_granulate_multilevel without initial centers would
+*/
+template <typename T, typename RNG>
+void skip_fcm_granulate_multilevel(RNG &rng, const granulation_shape &shape, size_t num_records)
+{
+	if (shape.num_chunks == 1)
+	{
+		fcm_result<T>::skip_random_partition_matrix(rng, shape.num_granules, num_records);
+		return;
+	}
+	
+	for (size_t i = 0; i < shape.num_chunks; i++)
+	{
+		auto [chunk_begin, chunk_end] = shape.chunk(i, num_records);
+		fcm_result<T>::skip_random_partition_matrix(rng, shape.num_fine_granules, chunk_end - chunk_begin);
+	}
+	
+	fcm_result<T>::skip_random_partition_matrix(rng, shape.num_granules, shape.num_chunks * shape.num_fine_granules);
 }
 
 template <typename T, typename RNG>
@@ -200,7 +449,9 @@ void fcm_group(
 	const size_t num_clusters,
 	const T exponent,
 	const size_t num_iterations,
-	RNG &rng)
+	RNG &rng,
+	const deadline &until = {},
+	stage_progress *progress = nullptr)
 {	
 	auto result = fcm(
 		ds,
@@ -210,7 +461,10 @@ void fcm_group(
 		num_clusters,
 		exponent,
 		num_iterations,
-		rng
+		rng,
+		static_cast<const std::vector<T>*>(nullptr),
+		until,
+		progress
 	);
 	
 	const auto num_records = end_id - begin_id;
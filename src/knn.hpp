@@ -3,7 +3,10 @@
 #include <cassert>
 #include <limits>
 #include <chrono>
+#include <vector>
+#include <span>
 #include "dataset.hpp"
+#include "budget.hpp"
 
 template <typename T>
 T nan_distance_sqr_except_attr(const sparse_dataset<T> &ds, size_t id1, size_t id2)
@@ -22,75 +25,286 @@ T nan_distance_sqr_except_attr(const sparse_dataset<T> &ds, size_t id1, size_t i
 	return cnt > 0 ? dist_sqr * ds.num_attributes() / cnt : std::numeric_limits<T>::max();
 }
 
+/*
+	k nearest neighbors found for every (record, missing attribute) pair.
+	Only records which provide the attribute are considered neighbors.
+*/
 template <typename T>
-auto knn_impute(const sparse_dataset<T> &ds, int k)
+class knn_table
 {
-	auto imputed = ds;
+public:
+	using entry = std::pair<T, size_t>;
+	static constexpr size_t no_neighbor = static_cast<size_t>(-1);
+	static constexpr size_t stale_neighbor = static_cast<size_t>(-2);
+	static constexpr entry empty_entry{std::numeric_limits<T>::max(), no_neighbor};
 	
-	std::vector<std::pair<T, size_t>> nearest_arr(ds.size() * ds.num_attributes() * k + 1, {std::numeric_limits<T>::max(), -1});
-	auto nearest = [&nearest_arr, k, &ds](size_t id, int num_provided_attr, int num_neighbor) -> std::pair<T, size_t>&
+	knn_table(size_t num_records, size_t num_attributes, int k) :
+		m_num_records(num_records),
+		m_num_attributes(num_attributes),
+		m_k(k),
+		m_entries(num_records * num_attributes * k, empty_entry),
+		m_farthest(num_records * num_attributes, empty_entry)
 	{
-		return nearest_arr[id * k * ds.num_attributes() + k * num_provided_attr + num_neighbor];
-	};
+		assert(k > 0);
+	}
+	
+	auto size() const {return m_num_records;}
+	auto num_attributes() const {return m_num_attributes;}
+	auto k() const {return m_k;}
+	
+	std::span<const entry> neighbors(size_t id, size_t attr) const
+	{
+		return {&m_entries[get_list(id, attr) * m_k], static_cast<size_t>(m_k)};
+	}
 	
-	auto update_nearest = [&nearest, k](size_t id, int num_provided_attr, T new_dist, size_t neighbor_id)
+	/*
+		Ties are broken by neighbor id, so that lists end up the same
+		regardless of the order in which candidates were offered
+	*/
+	void update(size_t id, size_t attr, T dist, size_t neighbor_id)
 	{
-		auto farthest = std::max_element(
-			&nearest(id, num_provided_attr, 0),
-			&nearest(id, num_provided_attr, k),
-			[](auto a, auto b){return a.first < b.first;}
-		);
+		// Most candidates are rejected here, without looking at the list
+		auto list = get_list(id, attr);
+		entry e{dist, neighbor_id};
+		if (!(e < m_farthest[list]) || dist == std::numeric_limits<T>::max())
+			return;
 		
-		if (new_dist < farthest->first)
-			*farthest = {new_dist, neighbor_id};
-	};
+		*farthest_entry(list) = e;
+		m_farthest[list] = *farthest_entry(list);
+	}
 	
+	void set(size_t id, size_t attr, int num_neighbor, const entry &e)
+	{
+		assert(num_neighbor < m_k);
+		auto list = get_list(id, attr);
+		m_entries[list * m_k + num_neighbor] = e;
+		m_farthest[list] = *farthest_entry(list);
+	}
 	
-	for (size_t i = 0; i < ds.size(); i++)
+	void clear(size_t id)
 	{
-		for (size_t j = 0; j < i; j++)
+		for (size_t attr = 0; attr < m_num_attributes; attr++)
 		{
-			assert(j < i);
-			
-			// There's no use in searching neighbors in data from the same source
-			// (the same fields will be missing - no gain)
-			if (ds.get_source(i) == ds.get_source(j))
-				continue;
-			
-			T dist = nan_distance_sqr_except_attr(ds, i, j);
+			auto list = get_list(id, attr);
+			std::fill_n(&m_entries[list * m_k], m_k, empty_entry);
+			m_farthest[list] = empty_entry;
+		}
+	}
+	
+	const std::vector<entry> &entries() const {return m_entries;}
+	
+private:
+	size_t get_list(size_t id, size_t attr) const
+	{
+		assert(id < m_num_records);
+		assert(attr < m_num_attributes);
+		return id * m_num_attributes + attr;
+	}
+	
+	entry *farthest_entry(size_t list)
+	{
+		return std::max_element(&m_entries[list * m_k], &m_entries[list * m_k] + m_k);
+	}
+	
+	size_t m_num_records;
+	size_t m_num_attributes;
+	int m_k;
+	std::vector<entry> m_entries;
+	std::vector<entry> m_farthest; // farthest neighbor in each list
+};
+
+/*
+	Offers records i and j to each other's neighbor lists.
+	When `symmetric` is false, only the lists of record i are updated.
+*/
+template <typename T>
+void knn_visit_pair(const sparse_dataset<T> &ds, knn_table<T> &table, size_t i, size_t j, bool symmetric = true)
+{
+	// There's no use in searching neighbors in data from the same source
+	// (the same fields will be missing - no gain)
+	if (ds.get_source(i) == ds.get_source(j))
+		return;
+		
+	T dist = nan_distance_sqr_except_attr(ds, i, j);
+	
+	for (size_t attr_id = 0; attr_id < ds.num_attributes(); attr_id++)
+	{
+		if (ds.get(i, attr_id) && !ds.get(j, attr_id)) // i has attribute, j is missing it
+		{
+			if (symmetric)
+				table.update(j, attr_id, dist, i);
+		}
+		else if (ds.get(j, attr_id) && !ds.get(i, attr_id)) // j has attribute, i is missing it
+			table.update(i, attr_id, dist, j);
+	}
+}
+
+/*
+	Number of record pairs visited between deadline checks - a fraction of a millisecond
+*/
+constexpr size_t knn_deadline_pairs = 1 << 14;
+
+/*
+	Progress of knn search over the first `num_records` of `total` records, in record pairs
+*/
+inline stage_progress knn_progress(size_t num_records, size_t total)
+{
+	return {num_records * (num_records - (num_records > 0)) / 2, total * (total - (total > 0)) / 2};
+}
+
+/*
+	Visits pairs (i, j) for j < i and i in [row_begin, row_end) - a block of rows of the pair space.
+	When the deadline passes, search stops within knn_deadline_pairs pairs, possibly in the middle of a row.
+	Returns the number of pairs visited.
+*/
+template <typename T>
+size_t knn_search_rows(const sparse_dataset<T> &ds, knn_table<T> &table, size_t row_begin, size_t row_end, const deadline &until = {})
+{
+	size_t num_pairs = 0;
+	for (size_t i = row_begin; i < row_end; i++)
+		for (size_t j = 0; j < i; j++, num_pairs++)
+		{
+			if (num_pairs % knn_deadline_pairs == 0 && deadline_passed(until))
+				return num_pairs;
+				
+			knn_visit_pair(ds, table, i, j);
+		}
+		
+	return num_pairs;
+}
+
+/*
+	When the deadline passes, search stops within knn_deadline_pairs pairs
+	and returns neighbors found so far.
+*/
+template <typename T>
+knn_table<T> knn_search(const sparse_dataset<T> &ds, int k, const deadline &until = {}, stage_progress *progress = nullptr)
+{
+	knn_table<T> table(ds.size(), ds.num_attributes(), k);
+	auto num_pairs = knn_search_rows(ds, table, 0, ds.size(), until);
+	
+	if (progress)
+		*progress = {num_pairs, knn_progress(ds.size(), ds.size()).total};
+		
+	return table;
+}
+
+/*
+	Brings a neighbor table from a previous run up to date. `table` must already
+	be indexed with the current record ids - neighbors which no longer exist
+	should be marked as stale. `dirty` marks records which are new or changed.
+	
+	Records whose lists reference dirty or stale records are searched from
+	scratch. All remaining lists are still exact with respect to the unchanged
+	records, so they only need to be offered the dirty ones.
+	
+	Returns number of records searched from scratch.
+*/
+template <typename T>
+size_t knn_search_incremental(const sparse_dataset<T> &ds, knn_table<T> &table, const std::vector<bool> &dirty)
+{
+	assert(table.size() == ds.size());
+	assert(table.num_attributes() == ds.num_attributes());
+	assert(dirty.size() == ds.size());
+	
+	std::vector<bool> rescan = dirty;
+	for (size_t id = 0; id < ds.size(); id++)
+		for (size_t attr_id = 0; attr_id < ds.num_attributes() && !rescan[id]; attr_id++)
+			for (const auto &[dist, neighbor_id] : table.neighbors(id, attr_id))
+				if (neighbor_id == knn_table<T>::stale_neighbor || (neighbor_id != knn_table<T>::no_neighbor && dirty[neighbor_id]))
+				{
+					rescan[id] = true;
+					break;
+				}
+				
+	std::vector<size_t> dirty_ids;
+	for (size_t id = 0; id < ds.size(); id++)
+		if (dirty[id])
+			dirty_ids.push_back(id);
 			
-			for (size_t attr_id = 0; attr_id < ds.num_attributes(); attr_id++)
-			{
-				if (ds.get(i, attr_id) && !ds.get(j, attr_id)) // i has attribute, j is missing it
-					update_nearest(j, attr_id, dist, i);
-				else if (ds.get(j, attr_id) && !ds.get(i, attr_id)) // j has attribute, i is missing it
-					update_nearest(i, attr_id, dist, j);
-			}
+	size_t num_rescanned = 0;
+	for (size_t i = 0; i < ds.size(); i++)
+	{
+		if (rescan[i])
+		{
+			table.clear(i);
+			for (size_t j = 0; j < ds.size(); j++)
+				if (j != i)
+					knn_visit_pair(ds, table, i, j, false);
+					
+			num_rescanned++;
+		}
+		else
+		{
+			for (auto j : dirty_ids)
+				knn_visit_pair(ds, table, i, j, false);
 		}
 	}
+	
+	return num_rescanned;
+}
 
+/*
+	Missing values are imputed with means of neighbors weighted by their record weights. Values without
+	any neighbor (e.g. when the search was cut short) are imputed with weighted attribute means.
+	Neighbors are summed from the nearest one, so that the result doesn't depend on their order in the table.
+*/
+template <typename T>
+auto knn_apply(const sparse_dataset<T> &ds, const knn_table<T> &table)
+{
+	assert(table.size() == ds.size());
+	auto imputed = ds;
 	
+	std::vector<std::optional<T>> attribute_means(ds.num_attributes());
+	auto attribute_mean = [&](size_t attr_id) -> T
+	{
+		if (!attribute_means[attr_id])
+		{
+			T sum = 0;
+			T weight_sum = 0;
+			for (size_t id = 0; id < ds.size(); id++)
+				if (auto value = ds.get(id, attr_id))
+				{
+					sum += ds.get_weight(id) * *value;
+					weight_sum += ds.get_weight(id);
+				}
+				
+			attribute_means[attr_id] = weight_sum > 0 ? sum / weight_sum : 0;
+		}
+		
+		return *attribute_means[attr_id];
+	};
+	
+	std::vector<typename knn_table<T>::entry> neighbors;
 	for (size_t id = 0; id < ds.size(); id++)
 		for (size_t attr_id = 0; attr_id < ds.num_attributes(); attr_id++)
 			if (!ds.get(id, attr_id))
 			{
 				T sum = 0;
-				int neigh_count = 0;
+				T weight_sum = 0;
+				
+				auto list = table.neighbors(id, attr_id);
+				neighbors.assign(list.begin(), list.end());
+				std::sort(neighbors.begin(), neighbors.end());
 				
-				for (int i = 0; i < k; i++)
+				for (const auto &neigh : neighbors)
 				{
-					auto neigh = nearest(id, attr_id, i);
-					if (neigh.second != static_cast<size_t>(-1))
+					if (neigh.second != knn_table<T>::no_neighbor)
 					{
 						assert(ds.get(neigh.second, attr_id));
-						sum += *ds.get(neigh.second, attr_id);
-						neigh_count++;
+						sum += ds.get_weight(neigh.second) * *ds.get(neigh.second, attr_id);
+						weight_sum += ds.get_weight(neigh.second);
 					}
 				}
-			
-				assert(neigh_count);
-				imputed.get_ref(id, attr_id) = sum / neigh_count;
+				
+				imputed.get_ref(id, attr_id) = weight_sum > 0 ? sum / weight_sum : attribute_mean(attr_id);
 			}
-	
+			
 	return imputed;
 }
+
+template <typename T>
+auto knn_impute(const sparse_dataset<T> &ds, int k)
+{
+	return knn_apply(ds, knn_search(ds, k));
+}
@@ -0,0 +1,251 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <type_traits>
+#include <vector>
+#include "dataset.hpp"
+#include "knn.hpp"
+
+/*
+	Reduced-precision copy of a sparse_dataset used only for the neighbor search.
+	Every attribute is scaled separately to the whole range of Q, the lowest value of Q marks missing data.
+	Data is stored column by column, so that distances to many records can be computed at once.
+	Rounding errors are measured, so that quantized data gives lower bounds of exact distances.
+*/
+template <typename Q, typename T>
+class quantized_dataset
+{
+	static_assert(std::is_integral_v<Q> && std::is_signed_v<Q>, "quantized_dataset must contain signed integers");
+	
+public:
+	static constexpr Q missing = std::numeric_limits<Q>::min();
+	
+	explicit quantized_dataset(const sparse_dataset<T> &ds);
+	
+	auto size() const {return m_size;}
+	auto num_attributes() const {return m_num_attributes;}
+	
+	const Q *column(size_t attr) const {return &m_data[attr * m_size];}
+	T weight(size_t attr) const {return m_weights[attr];}
+	T error(size_t attr) const {return m_errors[attr];}
+	
+	// Bit set of attributes present in the record
+	std::span<const std::uint64_t> mask(size_t id) const {return {&m_masks[id * m_mask_words], m_mask_words};}
+	
+	void distances(size_t id, size_t begin, size_t end, T *dist_sqr, T *cnt) const;
+	
+private:
+	size_t m_size;
+	size_t m_num_attributes;
+	size_t m_mask_words;
+	std::vector<Q> m_data;
+	std::vector<T> m_weights; // squared quantization steps
+	std::vector<T> m_errors; // bounds of differences between two values lost by rounding, in steps
+	std::vector<std::uint64_t> m_masks;
+};
+
+template <typename Q, typename T>
+quantized_dataset<Q, T>::quantized_dataset(const sparse_dataset<T> &ds) :
+	m_size(ds.size()),
+	m_num_attributes(ds.num_attributes()),
+	m_mask_words((ds.num_attributes() + 63) / 64),
+	m_data(ds.size() * ds.num_attributes(), missing),
+	m_weights(ds.num_attributes()),
+	m_errors(ds.num_attributes()),
+	m_masks(ds.size() * m_mask_words)
+{
+	constexpr T num_steps = static_cast<T>(std::numeric_limits<Q>::max()) - (missing + 1);
+	
+	for (size_t attr_id = 0; attr_id < m_num_attributes; attr_id++)
+	{
+		T min = std::numeric_limits<T>::max();
+		T max = std::numeric_limits<T>::lowest();
+		
+		for (size_t id = 0; id < ds.size(); id++)
+			if (auto value = ds.get(id, attr_id))
+			{
+				min = std::min(min, *value);
+				max = std::max(max, *value);
+			}
+			
+		T step = max > min ? (max - min) / num_steps : 1;
+		m_weights[attr_id] = step * step;
+		
+		double max_error = 0;
+		for (size_t id = 0; id < ds.size(); id++)
+			if (auto value = ds.get(id, attr_id))
+			{
+				auto q = std::lround((*value - min) / step);
+				m_data[attr_id * m_size + id] = static_cast<Q>(q + (missing + 1));
+				m_masks[id * m_mask_words + attr_id / 64] |= std::uint64_t{1} << (attr_id % 64);
+				max_error = std::max(max_error, std::abs(*value - (min + static_cast<double>(step) * q)));
+			}
+			
+		// Rounded up, so that the float doesn't end up below the bound
+		m_errors[attr_id] = std::nextafter(static_cast<T>(2 * max_error / step), std::numeric_limits<T>::max());
+	}
+}
+
+/*
+	Lower bound of nan_distance_sqr_except_attr between record `id` and records [begin, end).
+	Stores sums of squared differences and numbers of common attributes. Differences are
+	reduced by the rounding errors of both values. Sums are accumulated in T, as attributes
+	have different steps. Loops over records are branchless and independent, so that the
+	compiler can vectorize them.
+*/
+template <typename Q, typename T>
+void quantized_dataset<Q, T>::distances(size_t id, size_t begin, size_t end, T *dist_sqr, T *cnt) const
+{
+	const auto num_records = end - begin;
+	std::fill_n(dist_sqr, num_records, 0);
+	std::fill_n(cnt, num_records, 0);
+	
+	for (size_t attr_id = 0; attr_id < m_num_attributes; attr_id++)
+	{
+		const Q *values = column(attr_id);
+		const Q value = values[id];
+		if (value == missing)
+			continue;
+			
+		const T w = m_weights[attr_id];
+		const T error = m_errors[attr_id];
+		values += begin;
+		
+		for (size_t i = 0; i < num_records; i++)
+		{
+			// Difference of two int16 values doesn't fit in int16 and its square doesn't fit in int32
+			auto diff = std::max(std::abs(static_cast<T>(std::int32_t{values[i]} - value)) - error, T{0});
+			T present = values[i] != missing;
+			dist_sqr[i] += present * w * diff * diff;
+			cnt[i] += present;
+		}
+	}
+}
+
+/*
+	knn_search over quantized data. `rerank_factor` times more candidates than needed
+	are collected by lower bounds of distances and the best k of them are then selected
+	using exact distances. Records which weren't collected are at least as far as the
+	farthest candidate's bound, so a list is exact when its k-th distance is below that
+	bound. Records with any other list are searched again with exact distances, so the
+	result is the same as the one of knn_search.
+*/
+template <typename Q, typename T>
+knn_table<T> knn_search_quantized(const sparse_dataset<T> &ds, int k, int rerank_factor = 2, const deadline &until = {}, stage_progress *progress = nullptr)
+{
+	constexpr size_t block_size = 1024;
+	
+	// Covers rounding of the sums of up to num_attributes terms, both here and in exact distances
+	const T slack = 1 - 4 * (ds.num_attributes() + 4) * std::numeric_limits<T>::epsilon();
+	
+	quantized_dataset<Q, T> quantized{ds};
+	knn_table<T> candidates(ds.size(), ds.num_attributes(), k * rerank_factor);
+	std::vector<T> dist_sqr(block_size), cnt(block_size);
+	
+	// Pairs (i, j) were visited for i < stop_row and for i = stop_row, j < stop_column
+	size_t stop_row = ds.size(), stop_column = 0;
+	size_t num_pairs = 0;
+	
+	for (size_t i = 0; i < ds.size() && stop_row == ds.size(); i++)
+	{
+		auto mask_i = quantized.mask(i);
+		
+		for (size_t block_begin = 0; block_begin < i; block_begin += block_size)
+		{
+			// A block is far shorter than knn_deadline_pairs
+			if (deadline_passed(until))
+			{
+				stop_row = i;
+				stop_column = block_begin;
+				break;
+			}
+			
+			auto block_end = std::min(i, block_begin + block_size);
+			num_pairs += block_end - block_begin;
+			quantized.distances(i, block_begin, block_end, dist_sqr.data(), cnt.data());
+			
+			for (size_t j = block_begin; j < block_end; j++)
+			{
+				// There's no use in searching neighbors in data from the same source
+				if (ds.get_source(i) == ds.get_source(j))
+					continue;
+					
+				auto c = cnt[j - block_begin];
+				T dist = c > 0 ? slack * dist_sqr[j - block_begin] * ds.num_attributes() / c : std::numeric_limits<T>::max();
+				auto mask_j = quantized.mask(j);
+				
+				for (size_t word = 0; word < mask_i.size(); word++)
+				{
+					// i has attribute, j is missing it
+					for (auto bits = mask_i[word] & ~mask_j[word]; bits; bits &= bits - 1)
+						candidates.update(j, word * 64 + std::countr_zero(bits), dist, i);
+						
+					// j has attribute, i is missing it
+					for (auto bits = mask_j[word] & ~mask_i[word]; bits; bits &= bits - 1)
+						candidates.update(i, word * 64 + std::countr_zero(bits), dist, j);
+				}
+			}
+		}
+	}
+	
+	if (progress)
+		*progress = {num_pairs, knn_progress(ds.size(), ds.size()).total};
+		
+	auto visited = [&](size_t id1, size_t id2)
+	{
+		auto [low, high] = std::minmax(id1, id2);
+		return high < stop_row || (high == stop_row && low < stop_column);
+	};
+	
+	// Lists of records after the stop row are empty
+	knn_table<T> table(ds.size(), ds.num_attributes(), k);
+	for (size_t id = 0; id < std::min(stop_row + 1, ds.size()); id++)
+	{
+		bool exact = true;
+		for (size_t attr_id = 0; attr_id < ds.num_attributes(); attr_id++)
+		{
+			auto list = candidates.neighbors(id, attr_id);
+			for (const auto &[bound, neighbor_id] : list)
+				if (neighbor_id != knn_table<T>::no_neighbor)
+					table.update(id, attr_id, nan_distance_sqr_except_attr(ds, id, neighbor_id), neighbor_id);
+					
+			// A list with free places already holds every record searched
+			auto farthest = *std::max_element(list.begin(), list.end());
+			auto neighbors = table.neighbors(id, attr_id);
+			if (farthest.second != knn_table<T>::no_neighbor && !(std::max_element(neighbors.begin(), neighbors.end())->first < farthest.first))
+				exact = false;
+		}
+		
+		// Only pairs visited by the quantized search
+		if (!exact)
+		{
+			table.clear(id);
+			for (size_t j = 0; j < ds.size(); j++)
+				if (j != id && visited(id, j))
+					knn_visit_pair(ds, table, id, j, false);
+		}
+	}
+	
+	return table;
+}
+
+/*
+	Selects neighbor search by precision of the data - 16 or 32 (no quantization) bits.
+	Both give the same neighbors, 16 bits is faster.
+*/
+template <typename T>
+knn_table<T> knn_search(const sparse_dataset<T> &ds, int k, int precision, const deadline &until = {}, stage_progress *progress = nullptr)
+{
+	switch (precision)
+	{
+		case 16:
+			return knn_search_quantized<std::int16_t>(ds, k, 2, until, progress);
+		default:
+			assert(precision == 32);
+			return knn_search(ds, k, until, progress);
+	}
+}
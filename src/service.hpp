@@ -0,0 +1,519 @@
+#pragma once
+#include "algo.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+	Service mode - keeps datasets loaded and serves requests over a Unix domain socket.
+	
+	Usage: ntwi --serve <socket path> <dataset dir>... [--workers N] [--queue N] [--connections N]
+	
+	Protocol is line-based. Each request is a single line, each response is
+	zero or more lines of output followed by a status line - either
+	"ok <latency in seconds>" or "error <message>".
+	
+	Requests:
+		datasets                      - lists loaded datasets
+		run <dataset> [--option val]  - runs the algorithm, accepts the same options as the CLI
+		                                except for the ones referring to files
+		stats                         - latency statistics of completed run requests
+		
+	Run requests are executed by a fixed pool of workers. When more than
+	--queue requests are waiting, new ones are rejected with "error busy".
+	
+	Clients can't exhaust resources of the service: connections over --connections
+	are closed right away, and so are ones sending lines over max_request_length.
+	Run requests are rejected when their parameters exceed check_request_limits.
+*/
+
+constexpr size_t max_request_length = 64 * 1024;
+constexpr size_t max_request_cells = size_t{1} << 26;
+constexpr int max_request_iterations = 1000;
+constexpr double max_request_work = 1ull << 34;
+
+/*
+	Checks that a run request stays within the memory and time the service is willing to give it.
+	Numbers of neighbors and clusters can't exceed the number of rows they apply to
+	(records or granules), and neither neighbor lists nor partition matrices may have
+	more than max_request_cells cells. Each FCM iteration updates clusters^2 * rows
+	memberships - all of them together can't exceed max_request_work.
+	Options must be valid already (parse_options).
+*/
+inline bool check_request_limits(const run_options &options, const sparse_dataset<float> &dataset, std::string &error)
+{
+	const auto &config = options.config;
+	if (std::max({config.granulation.iterations, config.granulation.fine_iterations, config.clustering.iterations}) > max_request_iterations)
+	{
+		error = "Numbers of iterations can't exceed " + std::to_string(max_request_iterations);
+		return false;
+	}
+	
+	auto fcm_work = [](double num_clusters, double num_rows, double num_iterations)
+	{
+		return num_clusters * num_clusters * num_rows * num_iterations;
+	};
+	
+	// Rows of neighbor search and clustering, and the largest partition matrix of granulation
+	size_t num_rows = dataset.size();
+	size_t granulation_cells = 0;
+	double work = 0;
+	if (options.use_our_algo)
+	{
+		// Granulation errors are only measured by workers - counts they may pick are bounded instead
+		auto bound_config = config;
+		if (config.granulation.granule_error > 0)
+		{
+			bound_config.granulation.granule_error = 0;
+			bound_config.granulation.num_granules = granule_error_max_granules;
+		}
+		
+		num_rows = 0;
+		for (size_t source = 0; source < dataset.num_sources(); source++)
+		{
+			auto [record_begin, record_end] = dataset.get_source_data_range(source);
+			auto shape = source_granulation(bound_config, dataset, record_begin, record_end);
+			auto [chunk_begin, chunk_end] = shape.chunk(0, record_end - record_begin);
+			
+			num_rows += shape.num_granules;
+			if (shape.num_chunks > 1)
+			{
+				granulation_cells = std::max({granulation_cells, shape.num_fine_granules * (chunk_end - chunk_begin + 1), shape.num_granules * shape.num_chunks * shape.num_fine_granules});
+				work += fcm_work(shape.num_fine_granules, record_end - record_begin, config.granulation.fine_iterations);
+				work += fcm_work(shape.num_granules, shape.num_chunks * shape.num_fine_granules, config.granulation.iterations);
+			}
+			else
+			{
+				granulation_cells = std::max(granulation_cells, shape.num_granules * (record_end - record_begin));
+				work += fcm_work(shape.num_granules, record_end - record_begin, config.granulation.iterations);
+			}
+		}
+	}
+	
+	const auto k = static_cast<size_t>(config.imputation.knn_neighbors);
+	const auto num_clusters = static_cast<size_t>(config.clustering.num_final_clusters);
+	if (k > num_rows || num_clusters > num_rows)
+	{
+		error = "Numbers of neighbors and clusters can't exceed " + std::to_string(num_rows) + " for this dataset";
+		return false;
+	}
+	
+	if (std::max({num_rows * dataset.num_attributes() * k, num_clusters * num_rows, granulation_cells}) > max_request_cells)
+	{
+		error = "Request needs too much memory - reduce numbers of neighbors, clusters or granules";
+		return false;
+	}
+	
+	if (work + fcm_work(num_clusters, num_rows, config.clustering.iterations) > max_request_work)
+	{
+		error = "Request needs too much computation - reduce numbers of clusters, granules or iterations";
+		return false;
+	}
+	
+	return true;
+}
+
+class latency_stats
+{
+public:
+	void add(double queue_time, double compute_time)
+	{
+		std::lock_guard lock{m_mutex};
+		m_count++;
+		m_total_sum += queue_time + compute_time;
+		m_compute_sum += compute_time;
+		
+		if (m_total.size() < max_samples)
+		{
+			m_total.push_back(queue_time + compute_time);
+			m_compute.push_back(compute_time);
+		}
+		else
+		{
+			m_total[m_count % max_samples] = queue_time + compute_time;
+			m_compute[m_count % max_samples] = compute_time;
+		}
+	}
+	
+	void add_rejected()
+	{
+		std::lock_guard lock{m_mutex};
+		m_rejected++;
+	}
+	
+	void print(std::ostream &s) const
+	{
+		std::lock_guard lock{m_mutex};
+		s << "requests: " << m_count << "\n";
+		s << "rejected: " << m_rejected << "\n";
+		
+		if (m_count)
+		{
+			print_row(s, "total", m_total, m_total_sum / m_count);
+			print_row(s, "compute", m_compute, m_compute_sum / m_count);
+		}
+	}
+	
+private:
+	// Percentiles are computed over the most recent requests only
+	static constexpr size_t max_samples = 4096;
+	
+	static void print_row(std::ostream &s, const char *name, std::vector<double> samples, double mean)
+	{
+		std::sort(samples.begin(), samples.end());
+		auto percentile = [&](double p){return samples[static_cast<size_t>(p * (samples.size() - 1))];};
+		
+		s << std::setw(7) << name << " [s]: mean " << mean
+			<< ", p50 " << percentile(0.5)
+			<< ", p95 " << percentile(0.95)
+			<< ", p99 " << percentile(0.99)
+			<< ", max " << samples.back() << "\n";
+	}
+	
+	mutable std::mutex m_mutex;
+	size_t m_count = 0;
+	size_t m_rejected = 0;
+	double m_total_sum = 0;
+	double m_compute_sum = 0;
+	std::vector<double> m_total;
+	std::vector<double> m_compute;
+};
+
+class ntwi_service
+{
+public:
+	ntwi_service(std::map<std::string, sparse_dataset<float>> datasets, size_t num_workers, size_t max_queue, size_t max_connections);
+	~ntwi_service();
+	
+	// Accepts connections until the socket is shut down
+	void serve(const std::filesystem::path &socket_path);
+	void stop();
+	
+private:
+	using clock = std::chrono::steady_clock;
+	
+	struct job
+	{
+		const sparse_dataset<float> *dataset;
+		run_options options;
+		clock::time_point enqueue_time;
+		std::promise<std::string> response;
+	};
+	
+	void worker_loop();
+	void connection_loop(int fd);
+	void close_connection(int fd);
+	std::string handle_request(const std::string &line);
+	std::string handle_run(std::istringstream &request);
+	
+	std::map<std::string, sparse_dataset<float>> m_datasets;
+	size_t m_max_queue;
+	size_t m_max_connections;
+	latency_stats m_stats;
+	
+	std::mutex m_queue_mutex;
+	std::condition_variable m_queue_cv;
+	std::deque<std::shared_ptr<job>> m_queue;
+	bool m_stopping = false;
+	std::vector<std::thread> m_workers;
+	
+	std::atomic<int> m_listen_fd = -1;
+	
+	std::mutex m_connections_mutex;
+	std::condition_variable m_connections_cv;
+	std::set<int> m_connections;
+};
+
+inline ntwi_service::ntwi_service(std::map<std::string, sparse_dataset<float>> datasets, size_t num_workers, size_t max_queue, size_t max_connections) :
+	m_datasets(std::move(datasets)),
+	m_max_queue(max_queue),
+	m_max_connections(max_connections)
+{
+	assert(num_workers);
+	for (size_t i = 0; i < num_workers; i++)
+		m_workers.emplace_back(&ntwi_service::worker_loop, this);
+}
+
+inline ntwi_service::~ntwi_service()
+{
+	{
+		std::lock_guard lock{m_queue_mutex};
+		m_stopping = true;
+	}
+	
+	m_queue_cv.notify_all();
+	for (auto &worker : m_workers)
+		worker.join();
+}
+
+inline void ntwi_service::serve(const std::filesystem::path &socket_path)
+{
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.native().size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("socket path too long");
+		
+	std::copy(socket_path.native().begin(), socket_path.native().end(), addr.sun_path);
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw std::runtime_error("cannot create socket");
+		
+	// Remove socket left by a previous instance
+	unlink(socket_path.c_str());
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+	{
+		close(fd);
+		throw std::runtime_error("cannot listen on " + socket_path.string());
+	}
+	
+	m_listen_fd = fd;
+	LOG << "listening on " << socket_path << "\n";
+	
+	int client_fd;
+	while ((client_fd = accept(fd, nullptr, nullptr)) >= 0)
+	{
+		std::lock_guard lock{m_connections_mutex};
+		if (m_connections.size() >= m_max_connections)
+		{
+			// Best effort - a client which doesn't read it just sees the connection closed
+			static constexpr char response[] = "error too many connections\n";
+			send(client_fd, response, sizeof(response) - 1, MSG_DONTWAIT);
+			close(client_fd);
+			continue;
+		}
+		
+		m_connections.insert(client_fd);
+		std::thread{&ntwi_service::connection_loop, this, client_fd}.detach();
+	}
+	
+	m_listen_fd = -1;
+	close(fd);
+	unlink(socket_path.c_str());
+	
+	// Connections finish their current request and close
+	std::unique_lock lock{m_connections_mutex};
+	for (auto client : m_connections)
+		shutdown(client, SHUT_RD);
+		
+	m_connections_cv.wait(lock, [this]{return m_connections.empty();});
+}
+
+inline void ntwi_service::stop()
+{
+	// Wakes up accept() - safe to call from signal handler
+	int fd = m_listen_fd;
+	if (fd >= 0)
+		shutdown(fd, SHUT_RDWR);
+}
+
+inline void ntwi_service::worker_loop()
+{
+	while (true)
+	{
+		std::shared_ptr<job> j;
+		{
+			std::unique_lock lock{m_queue_mutex};
+			m_queue_cv.wait(lock, [this]{return m_stopping || !m_queue.empty();});
+			if (m_queue.empty())
+				return;
+				
+			j = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+		
+		auto t0 = clock::now();
+		std::ostringstream output;
+		try
+		{
+			run(j->options, *j->dataset, output);
+		}
+		catch (const std::exception &e)
+		{
+			j->response.set_value("error " + std::string{e.what()} + "\n");
+			continue;
+		}
+		auto t1 = clock::now();
+		
+		using namespace std::chrono_literals;
+		auto queue_time = (t0 - j->enqueue_time) / 1.0s;
+		auto compute_time = (t1 - t0) / 1.0s;
+		m_stats.add(queue_time, compute_time);
+		
+		output << "ok " << queue_time + compute_time << "\n";
+		j->response.set_value(output.str());
+	}
+}
+
+inline void ntwi_service::connection_loop(int fd)
+{
+	std::string buffer;
+	char chunk[4096];
+	ssize_t len;
+	
+	while ((len = read(fd, chunk, sizeof(chunk))) > 0)
+	{
+		buffer.append(chunk, len);
+		
+		size_t line_end;
+		while ((line_end = buffer.find('\n')) != std::string::npos)
+		{
+			auto line = buffer.substr(0, line_end);
+			buffer.erase(0, line_end + 1);
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+				
+			auto response = handle_request(line);
+			for (size_t written = 0; written < response.size();)
+			{
+				auto n = write(fd, response.data() + written, response.size() - written);
+				if (n <= 0)
+				{
+					close_connection(fd);
+					return;
+				}
+				written += n;
+			}
+		}
+		
+		if (buffer.size() > max_request_length)
+		{
+			static constexpr char response[] = "error request too long\n";
+			send(fd, response, sizeof(response) - 1, MSG_DONTWAIT);
+			break;
+		}
+	}
+	
+	close_connection(fd);
+}
+
+inline void ntwi_service::close_connection(int fd)
+{
+	// Under the lock, so that accept() can't reuse the descriptor before it's forgotten
+	std::lock_guard lock{m_connections_mutex};
+	m_connections.erase(fd);
+	close(fd);
+	m_connections_cv.notify_all();
+}
+
+inline std::string ntwi_service::handle_request(const std::string &line)
+{
+	std::istringstream request{line};
+	std::string command;
+	request >> command;
+	
+	if (command == "run")
+		return handle_run(request);
+		
+	std::ostringstream response;
+	if (command == "datasets")
+	{
+		for (const auto &[name, dataset] : m_datasets)
+			response << name << " " << dataset.size() << " records, " << dataset.num_sources() << " sources\n";
+	}
+	else if (command == "stats")
+		m_stats.print(response);
+	else
+		return "error unknown command\n";
+		
+	response << "ok 0\n";
+	return response.str();
+}
+
+inline std::string ntwi_service::handle_run(std::istringstream &request)
+{
+	std::string dataset_name;
+	request >> dataset_name;
+	
+	auto dataset = m_datasets.find(dataset_name);
+	if (dataset == m_datasets.end())
+		return "error unknown dataset " + dataset_name + "\n";
+		
+	std::vector<std::string> args{std::istream_iterator<std::string>{request}, std::istream_iterator<std::string>{}};
+	
+	auto j = std::make_shared<job>();
+	j->dataset = &dataset->second;
+	
+	std::string error;
+	if (!parse_options(j->options, args, error, true) || !check_request_limits(j->options, *j->dataset, error))
+		return "error " + error + "\n";
+		
+	auto response = j->response.get_future();
+	{
+		std::lock_guard lock{m_queue_mutex};
+		if (m_queue.size() >= m_max_queue)
+		{
+			m_stats.add_rejected();
+			return "error busy\n";
+		}
+		
+		j->enqueue_time = clock::now();
+		m_queue.push_back(std::move(j));
+	}
+	
+	m_queue_cv.notify_one();
+	return response.get();
+}
+
+inline ntwi_service *serve_instance = nullptr;
+
+inline int serve_main(int argc, char *argv[])
+{
+	if (argc < 4)
+	{
+		std::cerr << "Usage: " << argv[0] << " --serve <socket path> <dataset dir>... [--workers N] [--queue N] [--connections N]" << std::endl;
+		return 1;
+	}
+	
+	size_t num_workers = std::max(1u, std::thread::hardware_concurrency());
+	size_t max_queue = 64;
+	size_t max_connections = 64;
+	std::map<std::string, sparse_dataset<float>> datasets;
+	
+	for (int i = 3; i < argc; i++)
+	{
+		std::string arg{argv[i]};
+		if ((arg == "--workers" || arg == "--queue" || arg == "--connections") && i + 1 < argc)
+		{
+			auto value = std::stoul(argv[++i]);
+			(arg == "--workers" ? num_workers : arg == "--queue" ? max_queue : max_connections) = value;
+		}
+		else
+		{
+			std::cerr << "loading " << arg << "...\n";
+			datasets.emplace(arg, sparse_dataset<float>{arg});
+		}
+	}
+	
+	if (datasets.empty() || !num_workers || !max_connections)
+	{
+		std::cerr << "Please provide at least one dataset, worker and connection!" << std::endl;
+		return 1;
+	}
+	
+	// Broken connections shouldn't kill the service
+	std::signal(SIGPIPE, SIG_IGN);
+	
+	ntwi_service service{std::move(datasets), num_workers, max_queue, max_connections};
+	serve_instance = &service;
+	
+	auto on_signal = [](int){serve_instance->stop();};
+	std::signal(SIGINT, on_signal);
+	std::signal(SIGTERM, on_signal);
+	
+	std::cerr << "serving on " << argv[2] << " with " << num_workers << " workers\n";
+	service.serve(argv[2]);
+	serve_instance = nullptr;
+	
+	return 0;
+}
@@ -0,0 +1,333 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "dataset.hpp"
+#include "budget.hpp"
+#include "cache.hpp"
+#include "fcm.hpp"
+#include "knn.hpp"
+
+/*
+	Sharded execution - the coordinator splits a stage between forked worker processes.
+	Each worker writes its partial result to a file in a shared directory and the
+	coordinator merges them into the same result a single process would compute.
+*/
+
+/*
+	Directory for partial results of a single run, removed with all its contents on destruction
+*/
+class shard_workspace
+{
+public:
+	// Empty base - system temporary directory
+	explicit shard_workspace(std::filesystem::path base)
+	{
+		static std::atomic<size_t> counter = 0;
+		
+		if (base.empty())
+			base = std::filesystem::temp_directory_path();
+			
+		m_path = base / ("ntwi-" + std::to_string(getpid()) + "-" + std::to_string(counter++));
+		std::filesystem::create_directories(m_path);
+	}
+	
+	shard_workspace(const shard_workspace&) = delete;
+	shard_workspace &operator=(const shard_workspace&) = delete;
+	
+	~shard_workspace()
+	{
+		std::error_code ec;
+		std::filesystem::remove_all(m_path, ec);
+	}
+	
+	std::filesystem::path file(const std::string &stage, size_t shard) const
+	{
+		return m_path / (stage + "." + std::to_string(shard));
+	}
+	
+private:
+	std::filesystem::path m_path;
+};
+
+/*
+	Runs `work(shard)` for every shard in a separate process and waits for all of them.
+	Throws if any of the workers failed.
+*/
+template <typename F>
+void run_shards(size_t num_shards, F work)
+{
+	std::vector<pid_t> workers;
+	bool ok = true;
+	
+	for (size_t shard = 0; shard < num_shards && ok; shard++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			int status = 0;
+			try
+			{
+				work(shard);
+			}
+			catch (const std::exception &e)
+			{
+				std::cerr << "shard " << shard << " failed: " << e.what() << std::endl;
+				status = 1;
+			}
+			
+			// Skips destructors and buffered output of the copied coordinator state
+			_exit(status);
+		}
+		
+		if (pid < 0)
+			ok = false;
+		else
+			workers.push_back(pid);
+	}
+	
+	for (auto pid : workers)
+	{
+		int status;
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			ok = false;
+	}
+	
+	if (!ok)
+		throw std::runtime_error("shard worker failed");
+}
+
+/*
+	Upper limit of the number of shards - one worker per hardware thread
+*/
+inline size_t max_shards()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+inline std::ifstream open_shard_file(const std::filesystem::path &path, std::uint64_t magic)
+{
+	std::ifstream f{path, std::ios::binary};
+	std::uint64_t file_magic;
+	if (!binary_read(f, file_magic) || file_magic != magic)
+		throw std::runtime_error("invalid shard file " + path.string());
+		
+	return f;
+}
+
+/*
+	fcm_granulate_multilevel of every source with its shape, contiguous ranges of sources are granulated by separate workers.
+	Every worker starts with the rng state the single process would have at its first source,
+	so granules are the same. On return `rng` is in the same state as after the single process run.
+*/
+template <typename T, typename RNG>
+void sharded_granulate(
+	const sparse_dataset<T> &input,
+	sparse_dataset<T> &output,
+	const std::vector<granulation_shape> &shapes,
+	const T exponent,
+	const size_t num_iterations,
+	const size_t fine_iterations,
+	RNG &rng,
+	const size_t num_shards,
+	const shard_workspace &workspace,
+	const deadline &until = {},
+	stage_progress *progress = nullptr)
+{
+	constexpr std::uint64_t magic = 0x314748534957544eull; // "NTWISHG1"
+	
+	// Source ranges with similar numbers of records
+	std::vector<size_t> first_sources{0};
+	std::vector<RNG> shard_rngs{rng};
+	for (size_t source = 0; source < input.num_sources(); source++)
+	{
+		auto [record_begin, record_end] = input.get_source_data_range(source);
+		if (record_begin * num_shards >= first_sources.size() * input.size() && source > first_sources.back())
+		{
+			first_sources.push_back(source);
+			shard_rngs.push_back(rng);
+		}
+		
+		skip_fcm_granulate_multilevel<T>(rng, shapes[source], record_end - record_begin);
+	}
+	
+	first_sources.push_back(input.num_sources());
+	
+	run_shards(shard_rngs.size(), [&](size_t shard)
+	{
+		auto &shard_rng = shard_rngs[shard];
+		sparse_dataset<T> granules{input.num_attributes()};
+		stage_progress shard_progress;
+		
+		auto shard_end = input.get_source_data_range(first_sources[shard + 1] - 1).second;
+		for (size_t source = first_sources[shard]; source < first_sources[shard + 1]; source++)
+		{
+			auto [record_begin, record_end] = input.get_source_data_range(source);
+			auto attribs = input.get_record_attribute_ids(record_begin);
+			
+			fcm_granulate_multilevel(
+				input,
+				granules,
+				record_begin,
+				record_end,
+				attribs,
+				shapes[source],
+				exponent,
+				num_iterations,
+				fine_iterations,
+				shard_rng,
+				static_cast<const std::vector<T>*>(nullptr),
+				partial_deadline(until, record_end - record_begin, shard_end - record_begin),
+				&shard_progress
+			);
+		}
+		
+		std::vector<std::uint64_t> sources;
+		std::vector<T> data, weights;
+		for (size_t id = 0; id < granules.size(); id++)
+		{
+			sources.push_back(granules.get_source(id));
+			weights.push_back(granules.get_weight(id));
+			for (size_t attr_id = 0; attr_id < granules.num_attributes(); attr_id++)
+				data.push_back(granules.get_ref(id, attr_id));
+		}
+		
+		write_file_atomically(workspace.file("granules", shard), [&](std::ostream &f)
+		{
+			binary_write(f, magic);
+			binary_write<std::uint64_t>(f, shard_progress.done);
+			binary_write<std::uint64_t>(f, shard_progress.total);
+			binary_write(f, sources);
+			binary_write(f, data);
+			binary_write(f, weights);
+		});
+	});
+	
+	// Merge - granules of all shards in order of sources
+	for (size_t shard = 0; shard < shard_rngs.size(); shard++)
+	{
+		auto f = open_shard_file(workspace.file("granules", shard), magic);
+		std::uint64_t done, total;
+		std::vector<std::uint64_t> sources;
+		std::vector<T> data, weights;
+		
+		bool ok = binary_read(f, done)
+			&& binary_read(f, total)
+			&& binary_read(f, sources)
+			&& binary_read(f, data)
+			&& binary_read(f, weights)
+			&& data.size() == sources.size() * output.num_attributes()
+			&& weights.size() == sources.size();
+			
+		if (!ok)
+			throw std::runtime_error("invalid granules of shard " + std::to_string(shard));
+			
+		for (size_t i = 0; i < sources.size(); i++)
+			output.insert(sources[i], std::span<T>{&data[i * output.num_attributes()], output.num_attributes()}, weights[i]);
+			
+		if (progress)
+		{
+			progress->done += done;
+			progress->total += total;
+		}
+	}
+}
+
+/*
+	knn_search with the pair space split into blocks of rows with similar numbers of pairs.
+	Each worker finds neighbors among pairs from its block, the partial lists are then
+	merged into the k nearest overall. Lists don't depend on the order in which neighbors
+	were found, so the result is the same as the one of knn_search.
+*/
+template <typename T>
+knn_table<T> sharded_knn_search(
+	const sparse_dataset<T> &ds,
+	int k,
+	size_t num_shards,
+	const shard_workspace &workspace,
+	const deadline &until = {},
+	stage_progress *progress = nullptr)
+{
+	constexpr std::uint64_t magic = 0x314b48534957544eull; // "NTWISHK1"
+	
+	// Every shard gets at least one row
+	num_shards = std::clamp<size_t>(num_shards, 1, std::max<size_t>(ds.size(), 1));
+	
+	// Rows [0, r) contain r(r - 1) / 2 pairs
+	std::vector<size_t> first_rows;
+	for (size_t shard = 0; shard < num_shards; shard++)
+		first_rows.push_back(std::lround(ds.size() * std::sqrt(static_cast<double>(shard) / num_shards)));
+		
+	first_rows.push_back(ds.size());
+	
+	run_shards(num_shards, [&](size_t shard)
+	{
+		knn_table<T> table(ds.size(), ds.num_attributes(), k);
+		auto begin = first_rows[shard];
+		auto num_pairs = knn_search_rows(ds, table, begin, first_rows[shard + 1], until);
+		
+		std::vector<T> dists;
+		std::vector<std::uint64_t> ids;
+		for (const auto &[dist, neighbor_id] : table.entries())
+		{
+			dists.push_back(dist);
+			ids.push_back(neighbor_id);
+		}
+		
+		write_file_atomically(workspace.file("knn", shard), [&](std::ostream &f)
+		{
+			binary_write(f, magic);
+			binary_write<std::uint64_t>(f, num_pairs);
+			binary_write<std::uint64_t>(f, knn_progress(first_rows[shard + 1], ds.size()).done - knn_progress(begin, ds.size()).done);
+			binary_write(f, dists);
+			binary_write(f, ids);
+		});
+	});
+	
+	// Merge - every partial list is offered to the complete table
+	knn_table<T> table(ds.size(), ds.num_attributes(), k);
+	stage_progress merged_progress;
+	
+	for (size_t shard = 0; shard < num_shards; shard++)
+	{
+		auto f = open_shard_file(workspace.file("knn", shard), magic);
+		std::uint64_t done, total;
+		std::vector<T> dists;
+		std::vector<std::uint64_t> ids;
+		
+		bool ok = binary_read(f, done)
+			&& binary_read(f, total)
+			&& binary_read(f, dists)
+			&& binary_read(f, ids)
+			&& dists.size() == table.entries().size()
+			&& ids.size() == dists.size();
+			
+		if (!ok)
+			throw std::runtime_error("invalid neighbors of shard " + std::to_string(shard));
+			
+		for (size_t i = 0; i < ids.size(); i++)
+		{
+			if (ids[i] == knn_table<T>::no_neighbor)
+				continue;
+				
+			auto list = i / k;
+			table.update(list / ds.num_attributes(), list % ds.num_attributes(), dists[i], ids[i]);
+		}
+		
+		merged_progress.done += done;
+		merged_progress.total += total;
+	}
+	
+	if (progress)
+		*progress = merged_progress;
+		
+	return table;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <cassert>
+#include <cmath>
+#include <optional>
+#include <span>
+#include <vector>
+
+/*
+	Read-only view of a single source stored in caller's memory.
+	Provides the subset of sparse_dataset interface used by fcm, without copying the data.
+	The viewed buffers must outlive the view.
+*/
+template <typename T>
+class source_view
+{
+public:
+	// `data` holds rows of attribute_ids.size() values each
+	static source_view rows(std::span<const T> data, std::span<const size_t> attribute_ids, size_t num_attributes, size_t source_id);
+	
+	// `columns[i]` holds `num_rows` values of attribute attribute_ids[i]
+	static source_view columns(std::span<const T* const> columns, size_t num_rows, std::span<const size_t> attribute_ids, size_t num_attributes, size_t source_id);
+	
+	auto size() const {return m_num_rows;}
+	auto num_attributes() const {return m_columns.size();}
+	size_t get_source(size_t id) const {return m_source_id;}
+	T get_weight(size_t id) const {return 1;}
+	const std::vector<size_t> &get_attribute_ids() const {return m_attribute_ids;}
+	std::vector<size_t> get_record_attribute_ids(size_t id) const {return m_attribute_ids;}
+	
+	std::optional<T> get(size_t id, size_t attr) const
+	{
+		assert(id < m_num_rows);
+		assert(attr < m_columns.size());
+		if (!m_columns[attr])
+			return {};
+			
+		// NaN marks missing values, like in sparse_dataset
+		auto value = m_columns[attr][id * m_stride];
+		return std::isnan(value) ? std::optional<T>{} : std::optional<T>{value};
+	}
+	
+private:
+	source_view(size_t num_rows, size_t stride, std::span<const size_t> attribute_ids, size_t num_attributes, size_t source_id) :
+		m_num_rows(num_rows),
+		m_stride(stride),
+		m_source_id(source_id),
+		m_columns(num_attributes, nullptr),
+		m_attribute_ids(attribute_ids.begin(), attribute_ids.end())
+	{
+	}
+	
+	size_t m_num_rows;
+	size_t m_stride;
+	size_t m_source_id;
+	std::vector<const T*> m_columns; // nullptr for attributes missing in this source
+	std::vector<size_t> m_attribute_ids;
+};
+
+template <typename T>
+source_view<T> source_view<T>::rows(std::span<const T> data, std::span<const size_t> attribute_ids, size_t num_attributes, size_t source_id)
+{
+	assert(!attribute_ids.empty());
+	assert(data.size() % attribute_ids.size() == 0);
+	
+	source_view view{data.size() / attribute_ids.size(), attribute_ids.size(), attribute_ids, num_attributes, source_id};
+	for (size_t col = 0; col < attribute_ids.size(); col++)
+		view.m_columns.at(attribute_ids[col]) = data.data() + col;
+		
+	return view;
+}
+
+template <typename T>
+source_view<T> source_view<T>::columns(std::span<const T* const> columns, size_t num_rows, std::span<const size_t> attribute_ids, size_t num_attributes, size_t source_id)
+{
+	assert(!attribute_ids.empty());
+	assert(columns.size() == attribute_ids.size());
+	
+	source_view view{num_rows, 1, attribute_ids, num_attributes, source_id};
+	for (size_t col = 0; col < attribute_ids.size(); col++)
+		view.m_columns.at(attribute_ids[col]) = columns[col];
+		
+	return view;
+}
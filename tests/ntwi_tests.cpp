@@ -0,0 +1,649 @@
+#include "algo.hpp"
+#include "api.hpp"
+#include "fcm.hpp"
+#include "knn.hpp"
+#include "quantize.hpp"
+#include "service.hpp"
+#include "shard.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <unistd.h>
+
+/*
+	Equivalence tests - every alternative path (API, incremental, sharded and quantized search)
+	must give exactly the same results as the plain one - and checks of inputs and limits.
+	Usage: ntwi_tests <data directory>
+*/
+
+static int num_failures = 0;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed\n"; \
+			num_failures++; \
+		} \
+	} while (false)
+	
+static bool throws_invalid_argument(const std::function<void()> &f)
+{
+	try
+	{
+		f();
+	}
+	catch (const std::invalid_argument&)
+	{
+		return true;
+	}
+	
+	return false;
+}
+
+// Lists don't keep neighbors in any particular order
+template <typename T>
+static bool same_neighbors(const knn_table<T> &a, const knn_table<T> &b)
+{
+	if (a.size() != b.size() || a.num_attributes() != b.num_attributes() || a.k() != b.k())
+		return false;
+		
+	for (size_t id = 0; id < a.size(); id++)
+		for (size_t attr_id = 0; attr_id < a.num_attributes(); attr_id++)
+		{
+			auto list_a = a.neighbors(id, attr_id);
+			auto list_b = b.neighbors(id, attr_id);
+			std::vector<typename knn_table<T>::entry> sorted_a(list_a.begin(), list_a.end());
+			std::vector<typename knn_table<T>::entry> sorted_b(list_b.begin(), list_b.end());
+			std::sort(sorted_a.begin(), sorted_a.end());
+			std::sort(sorted_b.begin(), sorted_b.end());
+			
+			if (sorted_a != sorted_b)
+				return false;
+		}
+		
+	return true;
+}
+
+static void test_api_matches_our_approach(const sparse_dataset<float> &ds)
+{
+	our_algo_config config;
+	std::ostringstream sink;
+	config.output = &sink;
+	
+	std::mt19937 rng{1};
+	config.rng = &rng;
+	auto expected = our_approach(config, ds);
+	
+	// Sources registered both as rows and as columns
+	for (bool by_rows : {true, false})
+	{
+		ntwi_pipeline pipeline{ds.num_attributes()};
+		std::vector<std::vector<size_t>> attribs;
+		std::vector<std::vector<float>> buffers;
+		std::vector<std::vector<const float*>> columns;
+		
+		for (size_t source = 0; source < ds.num_sources(); source++)
+		{
+			auto [record_begin, record_end] = ds.get_source_data_range(source);
+			attribs.push_back(ds.get_record_attribute_ids(record_begin));
+			buffers.emplace_back();
+			
+			if (by_rows)
+			{
+				for (size_t id = record_begin; id < record_end; id++)
+					for (auto attr_id : attribs.back())
+						buffers.back().push_back(*ds.get(id, attr_id));
+						
+				pipeline.add_source_rows(buffers.back(), attribs.back());
+			}
+			else
+			{
+				for (auto attr_id : attribs.back())
+					for (size_t id = record_begin; id < record_end; id++)
+						buffers.back().push_back(*ds.get(id, attr_id));
+						
+				columns.emplace_back();
+				for (size_t col = 0; col < attribs.back().size(); col++)
+					columns.back().push_back(buffers.back().data() + col * (record_end - record_begin));
+					
+				pipeline.add_source_columns(columns.back(), record_end - record_begin, attribs.back());
+			}
+		}
+		
+		rng.seed(1);
+		auto num_granules = pipeline.num_granules(config);
+		std::vector<float> granules(num_granules * ds.num_attributes()), weights(num_granules);
+		std::vector<size_t> granule_clusters(num_granules), record_clusters(pipeline.num_records());
+		pipeline.run(config, {granules, granule_clusters, record_clusters, weights, {}});
+		
+		CHECK(num_granules == expected.size());
+		for (size_t id = 0; id < std::min(num_granules, expected.size()); id++)
+		{
+			CHECK(granule_clusters[id] == expected.get_source(id));
+			CHECK(weights[id] == expected.get_weight(id));
+			
+			for (size_t attr_id = 0; attr_id < ds.num_attributes(); attr_id++)
+				CHECK(granules[id * ds.num_attributes() + attr_id] == expected.get_ref(id, attr_id));
+		}
+	}
+}
+
+static void test_api_rejects_invalid_input()
+{
+	ntwi_pipeline pipeline{3};
+	std::vector<float> data{1, 2, 3, 4, 5, 7};
+	std::vector<float> missing{1, 2, 3, NAN, 5, 7};
+	std::vector<size_t> attribs{0, 2};
+	std::vector<size_t> duplicate_attribs{0, 0};
+	
+	CHECK(throws_invalid_argument([&]{pipeline.add_source_rows(data, duplicate_attribs);}));
+	CHECK(throws_invalid_argument([&]{pipeline.add_source_rows(missing, attribs);}));
+	CHECK(!throws_invalid_argument([&]{pipeline.add_source_rows(data, attribs);}));
+	
+	std::mt19937 rng{1};
+	std::vector<float> granules(2 * pipeline.num_attributes());
+	std::vector<size_t> granule_clusters(2);
+	
+	auto run_with = [&](const std::function<void(our_algo_config&)> &change)
+	{
+		return throws_invalid_argument([&]
+		{
+			our_algo_config config;
+			config.rng = &rng;
+			config.granulation.num_granules = 2;
+			config.clustering.num_final_clusters = 1;
+			change(config);
+			pipeline.run(config, {granules, granule_clusters, {}, {}, {}});
+		});
+	};
+	
+	CHECK(!run_with([](auto&){}));
+	CHECK(run_with([](auto &config){config.time_budget = 1;}));
+	CHECK(run_with([](auto &config){config.sharding.num_shards = 2;}));
+	CHECK(run_with([](auto &config){config.incremental.cache_path = "cache";}));
+	CHECK(run_with([](auto &config){config.imputation.precision = 8;}));
+	CHECK(run_with([](auto &config){config.imputation.knn_neighbors = 0;}));
+	CHECK(run_with([](auto &config){config.imputation.knn_neighbors = -1;}));
+	CHECK(run_with([](auto &config){config.clustering.num_final_clusters = 0;}));
+	CHECK(run_with([](auto &config){config.clustering.iterations = 0;}));
+	CHECK(run_with([](auto &config){config.granulation.num_granules = 0;}));
+	CHECK(run_with([](auto &config){config.granulation.iterations = 0;}));
+	CHECK(run_with([](auto &config){config.granulation.fuzzy_exponent = 1;}));
+	CHECK(run_with([](auto &config){config.clustering.fuzzy_exponent = NAN;}));
+	CHECK(run_with([](auto &config){config.granulation.granule_error = NAN;}));
+	CHECK(run_with([](auto &config){config.granulation.granule_ratio = -1;}));
+	CHECK(throws_invalid_argument([&]
+	{
+		our_algo_config config;
+		config.imputation.knn_neighbors = 0;
+		pipeline.num_granules(config);
+	}));
+}
+
+// Four separated groups of 50 records
+static sparse_dataset<float> four_blobs()
+{
+	sparse_dataset<float> ds{2};
+	for (size_t i = 0; i < 200; i++)
+	{
+		std::vector<float> row{10.f * (i % 2) + 0.1f * (i / 4 % 5), 10.f * (i / 2 % 2) + 0.1f * (i / 20)};
+		ds.insert(0, row);
+	}
+	
+	return ds;
+}
+
+static void test_source_granulation()
+{
+	our_algo_config config;
+	auto ds = four_blobs();
+	
+	config.granulation.granule_ratio = 25;
+	CHECK(source_granulation(config, ds, 0, ds.size()).num_granules == 8);
+	config.granulation.granule_ratio = 1;
+	CHECK(source_granulation(config, ds, 0, ds.size()).num_granules == ds.size());
+	config.granulation.granule_ratio = 1000;
+	CHECK(source_granulation(config, ds, 0, ds.size()).num_granules == 1);
+	
+	// Two granules leave half of the variance, four hardly any
+	config.granulation.granule_ratio = 0;
+	config.granulation.granule_error = 0.05f;
+	stage_progress progress;
+	CHECK(source_granulation(config, ds, 0, ds.size(), {}, &progress).num_granules == 4);
+	CHECK(progress.complete() && progress.total == 1);
+	
+	// Search past its deadline stops at the first count
+	progress = {};
+	auto until = deadline_clock::now() - std::chrono::seconds(1);
+	CHECK(source_granulation(config, ds, 0, ds.size(), until, &progress).num_granules == 2);
+	CHECK(!progress.complete());
+	
+	config.granulation.granule_error = 0;
+	config.granulation.num_granules = 8;
+	config.granulation.fine_chunk_size = 50;
+	auto shape = source_granulation(config, ds, 0, ds.size());
+	CHECK(shape.num_granules == 8 && shape.num_chunks == 4 && shape.num_fine_granules == 8);
+	CHECK(granulation_levels(config, 99, 8).num_chunks == 1);
+	config.granulation.fine_chunk_size = 0;
+	CHECK(granulation_levels(config, ds.size(), 8).num_chunks == 1);
+}
+
+// As many granules as records - some coincide with records, which fcm mustn't divide by
+static void test_granule_per_record(const sparse_dataset<float> &ds)
+{
+	auto [record_begin, record_end] = ds.get_source_data_range(0);
+	auto attribs = ds.get_record_attribute_ids(record_begin);
+	
+	std::mt19937 rng{1};
+	sparse_dataset<float> granules{ds.num_attributes()}, spreads{ds.num_attributes()};
+	fcm_granulate<float>(ds, granules, record_begin, record_end, attribs, record_end - record_begin, 2.f, 10, rng, nullptr, {}, nullptr, &spreads);
+	
+	float weight_sum = 0;
+	for (size_t id = 0; id < granules.size(); id++)
+	{
+		weight_sum += granules.get_weight(id);
+		for (auto attr_id : attribs)
+			CHECK(std::isfinite(*granules.get(id, attr_id)) && std::isfinite(*spreads.get(id, attr_id)));
+	}
+	
+	CHECK(std::abs(weight_sum - (record_end - record_begin)) < 1e-3f);
+}
+
+static void test_incremental_knn_matches_full(const sparse_dataset<float> &ds)
+{
+	constexpr int k = 3;
+	auto previous = knn_search(ds, k);
+	
+	// Every 7th record changes
+	auto changed = ds;
+	std::vector<bool> dirty(ds.size());
+	for (size_t id = 0; id < ds.size(); id += 7)
+	{
+		dirty[id] = true;
+		for (size_t attr_id = 0; attr_id < ds.num_attributes(); attr_id++)
+			if (ds.get(id, attr_id))
+				changed.get_ref(id, attr_id) *= 1.5f;
+	}
+	
+	auto num_rescanned = knn_search_incremental(changed, previous, dirty);
+	CHECK(num_rescanned < ds.size());
+	CHECK(same_neighbors(previous, knn_search(changed, k)));
+}
+
+static std::string to_string(const sparse_dataset<float> &ds)
+{
+	std::ostringstream s;
+	s << ds;
+	return s.str();
+}
+
+// Changing only k reuses the granules and searches all their neighbors again
+static void test_cache_reuses_granules_for_other_k(const sparse_dataset<float> &ds)
+{
+	const auto cache_path = std::filesystem::temp_directory_path() / ("ntwi-tests-" + std::to_string(getpid()) + ".cache");
+	
+	auto run_with = [&](int k, bool cached, std::ostream &output)
+	{
+		our_algo_config config;
+		config.output = &output;
+		config.imputation.knn_neighbors = k;
+		config.print_times = cached;
+		if (cached)
+			config.incremental.cache_path = cache_path;
+			
+		std::mt19937 rng{1};
+		config.rng = &rng;
+		return our_approach(config, ds);
+	};
+	
+	std::ostringstream sink, report;
+	run_with(3, true, sink);
+	auto result = run_with(5, true, report);
+	auto num_granules = std::to_string(result.size());
+	
+	CHECK(to_string(result) == to_string(run_with(5, false, sink)));
+	CHECK(report.str().find("regranulated: 0/") != std::string::npos);
+	CHECK(report.str().find("rescanned: " + num_granules + "/" + num_granules) != std::string::npos);
+	std::filesystem::remove(cache_path);
+}
+
+static void test_quantized_knn_matches_exact(const sparse_dataset<float> &ds)
+{
+	CHECK(same_neighbors(knn_search(ds, 3, 16), knn_search(ds, 3)));
+}
+
+// Grid values give many equal distances, and lists longer than the number of candidates stay partly empty
+static void test_quantized_knn_with_ties()
+{
+	sparse_dataset<float> ds{3};
+	for (size_t source = 0; source < 3; source++)
+		for (size_t i = 0; i < 40; i++)
+		{
+			std::vector<float> row{float(i % 4), float(i / 4 % 3), float(i % 5) * 0.25f};
+			row[source] = NAN;
+			ds.insert(source, row);
+		}
+		
+	for (int k : {1, 5, 100})
+		CHECK(same_neighbors(knn_search(ds, k, 16), knn_search(ds, k)));
+		
+	run_options options;
+	std::string error;
+	CHECK(!parse_options(options, {"--knn-precision", "8"}, error));
+}
+
+static void test_sharded_matches_single(const sparse_dataset<float> &ds)
+{
+	shard_workspace workspace{""};
+	
+	for (size_t num_shards : {2, 3, 1000})
+		CHECK(same_neighbors(sharded_knn_search(ds, 3, num_shards, workspace), knn_search(ds, 3)));
+		
+	std::vector<granulation_shape> shapes;
+	for (size_t source = 0; source < ds.num_sources(); source++)
+		shapes.push_back(source % 3 ? granulation_shape{source % 2 ? 2u : 3u} : granulation_shape{2, 2, 2});
+		
+	std::mt19937 rng{1};
+	sparse_dataset<float> expected{ds.num_attributes()};
+	for (size_t source = 0; source < ds.num_sources(); source++)
+	{
+		auto [record_begin, record_end] = ds.get_source_data_range(source);
+		auto attribs = ds.get_record_attribute_ids(record_begin);
+		fcm_granulate_multilevel(ds, expected, record_begin, record_end, attribs, shapes[source], 2.f, 10, 3, rng);
+	}
+	
+	for (size_t num_shards : {2, 3})
+	{
+		std::mt19937 sharded_rng{1};
+		sparse_dataset<float> granules{ds.num_attributes()};
+		sharded_granulate(ds, granules, shapes, 2.f, 10, 3, sharded_rng, num_shards, workspace);
+		
+		CHECK(sharded_rng == rng);
+		CHECK(granules.size() == expected.size());
+		for (size_t id = 0; id < std::min(granules.size(), expected.size()); id++)
+		{
+			CHECK(granules.get_source(id) == expected.get_source(id));
+			CHECK(granules.get_weight(id) == expected.get_weight(id));
+			
+			for (size_t attr_id = 0; attr_id < ds.num_attributes(); attr_id++)
+				CHECK(granules.get(id, attr_id) == expected.get(id, attr_id));
+		}
+	}
+}
+
+// Granules stand for as many records as they were made of, also through two levels
+static void test_granule_weights(const sparse_dataset<float> &ds)
+{
+	auto [record_begin, record_end] = ds.get_source_data_range(0);
+	auto attribs = ds.get_record_attribute_ids(record_begin);
+	
+	for (auto shape : {granulation_shape{3}, granulation_shape{2, 2, 2}})
+	{
+		std::mt19937 rng{1};
+		sparse_dataset<float> granules{ds.num_attributes()};
+		fcm_granulate_multilevel(ds, granules, record_begin, record_end, attribs, shape, 2.f, 10, 3, rng);
+		
+		float weight_sum = 0;
+		for (size_t id = 0; id < granules.size(); id++)
+			weight_sum += granules.get_weight(id);
+			
+		CHECK(granules.size() == shape.num_granules);
+		CHECK(std::abs(weight_sum - (record_end - record_begin)) < 1e-3f);
+	}
+}
+
+// Rows are counted once, but weighted in means and variances
+static void test_weighted_eval_clustering()
+{
+	sparse_dataset<float> ds{2};
+	for (auto [cluster, value, weight] : {std::tuple{0, 0.f, 3.f}, {0, 4.f, 1.f}, {1, 10.f, 2.f}})
+	{
+		std::vector<float> row{value, 2 * value};
+		ds.insert(cluster, row, weight);
+	}
+	
+	std::ostringstream s;
+	eval_clustering(ds, 2, s);
+	CHECK(s.str() == "ID, Items, Var0, Var1\n0, 2, 3, 12\n1, 1, 0, 0\n");
+}
+
+static void test_deadlines()
+{
+	auto passed = deadline_clock::now() - std::chrono::seconds(1);
+	auto ds = four_blobs();
+	for (size_t i = 0; i < 800; i++)
+	{
+		std::vector<float> row{float(i % 13), float(i % 17)};
+		ds.insert(1, row);
+	}
+	
+	// Searches stop at the first check past the deadline, fcm after its first iteration
+	for (int precision : {16, 32})
+	{
+		stage_progress progress;
+		auto neighbors = knn_search(ds, 3, precision, passed, &progress);
+		CHECK(neighbors.size() == ds.size());
+		CHECK(progress.done < knn_deadline_pairs && !progress.complete());
+		
+		progress = {};
+		knn_search(ds, 3, precision, {}, &progress);
+		CHECK(progress.complete() && progress.total == knn_progress(ds.size(), ds.size()).total);
+	}
+	
+	std::mt19937 rng{1};
+	std::vector<size_t> attribs{0, 1};
+	stage_progress progress;
+	fcm<float>(ds, 0, ds.size(), attribs, 4, 2.f, 10, rng, nullptr, passed, &progress);
+	CHECK(progress.done == 1 && progress.total == 10);
+}
+
+static void test_time_budget()
+{
+	using namespace std::chrono_literals;
+	
+	time_budget unlimited{0, {{"first", 1}}};
+	CHECK(!unlimited.enabled() && !unlimited.begin_stage());
+	
+	// Stages get their shares of the time left when they begin
+	time_budget budget{0.4, {{"first", 1}, {"second", 3}}};
+	auto until = budget.begin_stage();
+	CHECK(until && *until - deadline_clock::now() <= 100ms && *until - deadline_clock::now() > 50ms);
+	budget.end_stage({1, 2});
+	
+	until = budget.begin_stage();
+	CHECK(until && *until - deadline_clock::now() > 250ms && *until - deadline_clock::now() <= 400ms);
+	budget.end_stage({5, 5});
+	
+	std::ostringstream report;
+	budget.print_report(report);
+	CHECK(report.str().find("first: ") != std::string::npos && report.str().find("cut short at 1/2 (50%)") != std::string::npos);
+	CHECK(report.str().find("second: ") != std::string::npos && report.str().find("complete") != std::string::npos);
+	
+	CHECK(partial_deadline(until, 1, 4) <= until);
+	CHECK(!partial_deadline({}, 1, 4));
+}
+
+static bool within_limits(const sparse_dataset<float> &ds, const std::vector<std::string> &args)
+{
+	run_options options;
+	std::string error;
+	return parse_options(options, args, error, true) && check_request_limits(options, ds, error);
+}
+
+static void test_request_limits(const sparse_dataset<float> &ds)
+{
+	// 10 sources of 10 records, 3 granules each by default
+	CHECK(within_limits(ds, {}));
+	CHECK(within_limits(ds, {"--knn", "30"}));
+	CHECK(!within_limits(ds, {"--knn", "31"}));
+	CHECK(within_limits(ds, {"--naive", "1", "--knn", "100"}));
+	CHECK(!within_limits(ds, {"--naive", "1", "--clusters", "101"}));
+	CHECK(within_limits(ds, {"--granule-ratio", "1", "--clusters", "100"}));
+	CHECK(!within_limits(ds, {"--clustering-iters", "1001"}));
+	CHECK(!within_limits(ds, {"--fine-iters", "1001"}));
+	CHECK(within_limits(ds, {"--granule-error", "0.1"}));
+	
+	sparse_dataset<float> large{2};
+	for (size_t i = 0; i < 6000; i++)
+	{
+		std::vector<float> row{float(i % 77), float(i % 91)};
+		large.insert(0, row);
+	}
+	
+	CHECK(within_limits(large, {"--naive", "1", "--knn", "1000"}));
+	CHECK(!within_limits(large, {"--naive", "1", "--knn", "6000"}));
+	CHECK(!within_limits(large, {"--naive", "1", "--clusters", "3000"}));
+	CHECK(!within_limits(large, {"--granule-ratio", "1"}));
+}
+
+static int connect_to(const std::filesystem::path &socket_path)
+{
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	std::copy(socket_path.native().begin(), socket_path.native().end(), addr.sun_path);
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+// Output up to and including the status line, or until the service closes the connection
+static std::string read_response(int fd)
+{
+	std::string response;
+	char c;
+	while (read(fd, &c, 1) == 1)
+	{
+		response += c;
+		auto line_begin = response.rfind('\n', response.size() - 2);
+		line_begin = line_begin == std::string::npos ? 0 : line_begin + 1;
+		if (c == '\n' && (response.compare(line_begin, 3, "ok ") == 0 || response.compare(line_begin, 6, "error ") == 0))
+			break;
+	}
+	
+	return response;
+}
+
+static bool starts_with(const std::string &str, const std::string &prefix)
+{
+	return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+static void test_service_connection_limits(const sparse_dataset<float> &ds)
+{
+	// The service closes connections which may still be written to
+	std::signal(SIGPIPE, SIG_IGN);
+	
+	const auto socket_path = std::filesystem::temp_directory_path() / ("ntwi-tests-" + std::to_string(getpid()) + ".sock");
+	ntwi_service service{{{"male", ds}}, 1, 4, 1};
+	std::thread server{[&]{service.serve(socket_path);}};
+	
+	// Wait for the socket to appear
+	int client = -1;
+	for (int attempt = 0; attempt < 100 && client < 0; attempt++)
+	{
+		client = connect_to(socket_path);
+		if (client < 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	
+	CHECK(client >= 0);
+	std::string request = "run male --knn 31\n";
+	CHECK(write(client, request.data(), request.size()) == ssize_t(request.size()));
+	CHECK(starts_with(read_response(client), "error Numbers of neighbors"));
+	
+	// The first connection is still open
+	int second = connect_to(socket_path);
+	CHECK(read_response(second) == "error too many connections\n");
+	close(second);
+	
+	std::string long_line(max_request_length + 4096, 'x');
+	CHECK(write(client, long_line.data(), long_line.size()) == ssize_t(long_line.size()));
+	CHECK(read_response(client) == "error request too long\n");
+	CHECK(read_response(client).empty());
+	close(client);
+	
+	service.stop();
+	server.join();
+}
+
+static void test_shard_options(const sparse_dataset<float> &ds)
+{
+	auto parse = [](const std::vector<std::string> &args, bool remote, run_options &options)
+	{
+		std::string error;
+		return parse_options(options, args, error, remote);
+	};
+	
+	run_options options;
+	CHECK(parse({"--shards", "100000"}, false, options));
+	CHECK(options.config.sharding.num_shards == int(max_shards()));
+	CHECK(!parse({"--shards", "2"}, true, options));
+	CHECK(!parse({"--shards", "0"}, false, options));
+	CHECK(!parse({"--shards", "2", "--knn-precision", "16"}, false, options));
+	CHECK(!parse({"--shards", "2", "--cache", "cache"}, false, options));
+	
+	// Shards past the deadline return partial results too
+	shard_workspace workspace{""};
+	stage_progress progress;
+	auto neighbors = sharded_knn_search(ds, 3, 2, workspace, deadline_clock::now() - std::chrono::seconds(1), &progress);
+	CHECK(neighbors.size() == ds.size() && !progress.complete());
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <data directory>" << std::endl;
+		return 2;
+	}
+	
+	const std::filesystem::path data_dir{argv[1]};
+	for (const auto &dataset_dir : {data_dir / "male" / "1", data_dir / "male" / "2"})
+	{
+		sparse_dataset<float> ds{dataset_dir};
+		test_api_matches_our_approach(ds);
+		test_incremental_knn_matches_full(ds);
+		test_cache_reuses_granules_for_other_k(ds);
+		test_quantized_knn_matches_exact(ds);
+		test_sharded_matches_single(ds);
+		test_granule_per_record(ds);
+		test_granule_weights(ds);
+	}
+	
+	test_api_rejects_invalid_input();
+	test_source_granulation();
+	test_weighted_eval_clustering();
+	test_quantized_knn_with_ties();
+	test_deadlines();
+	test_time_budget();
+	
+	sparse_dataset<float> ds{data_dir / "male" / "1"};
+	test_request_limits(ds);
+	test_shard_options(ds);
+	test_service_connection_limits(ds);
+	
+	if (num_failures)
+	{
+		std::cerr << num_failures << " checks failed" << std::endl;
+		return 1;
+	}
+	
+	std::cout << "all checks passed" << std::endl;
+	return 0;
+}